@@ -0,0 +1,125 @@
+/*
+* Copyright (c) 2019, Delft University of Technology
+*
+* apmap.h
+*
+* Library interface of Apmap. Link with libapmap.a, -lmetis and -lpthread.
+*/
+
+#ifndef _APMAP_H_
+#define _APMAP_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+* A connected component in CSR form. The arrays are only read and may be
+* released once the mapping call returns.
+*/
+typedef struct {
+  int nstate;             /* The # of states */
+  int nedge;              /* The # of transitions */
+  const int *xadj;        /* nstate + 1 offsets into adjncy */
+  const int *adjncy;      /* Destination of each transition, counted from 0 */
+  const unsigned *ste;    /* 8 words of accepting characters per state */
+  const char *start;      /* Whether a state is a start state */
+  const char *report;     /* Whether a state is a final state */
+  const char *const *name; /* STE names */
+} apmap_cc_t;
+
+/*
+* Map *ncc* connected components and write the configuration to *outfile*.
+* Returns the # of tiles used. Like the apmap program, it quits the process
+* if the components cannot be mapped, or if one of them is not a valid CSR
+* graph with a name for every state.
+*/
+float ApmapMapCC(const apmap_cc_t *cc, int ncc, int has_g4, int no_opt, const char *outfile);
+
+/*
+* Set the geometry of the chips for the following calls, as key=value items
+* such as "tiles=128,tile-size=256" (see apmap --help). It quits the process
+* if the geometry is invalid.
+*/
+void ApmapSetGeometry(const char *spec);
+
+/*
+* A route of a global switch in a binary configuration file (.apc).
+* Rows and columns count the ports of all tiles: tile * width + port, where
+* width is 2 for the 1-way switches and max_in - 2 * global_num (8 in the
+* default geometry) for the 4-way switch.
+*/
+typedef struct {
+  unsigned sw;  /* Switch index; global_num stands for the 4-way switch */
+  unsigned row; /* Input row */
+  unsigned col; /* Output column */
+} apmap_route_t;
+
+/*
+* The configuration of one tile. Bit c of row r of a bit matrix is
+* (m[r * rowbytes + c / 8] >> (c % 8)) & 1.
+*/
+typedef struct {
+  const unsigned *ste;         /* 8 words of accepting characters per STE */
+  const unsigned char *local;  /* Local switch: tile_size + max_in rows of tile_size
+                                  bits. Rows are STEs followed by switch inputs */
+  const unsigned char *start;  /* One bit per STE */
+  const unsigned char *report; /* One bit per STE */
+  const unsigned char *used;   /* One bit per STE, set if it holds a state */
+} apmap_tilecfg_t;
+
+/*
+* The configuration of one chip
+*/
+typedef struct {
+  int id;                     /* Chip index */
+  int ntile;                  /* The # of configured tiles, counted from tile 0 */
+  int has_g4;                 /* Whether the 4-way global switch is used */
+  int nroute;
+  const apmap_route_t *route; /* Sorted by switch, row and column */
+  const unsigned char *tile;  /* ntile packed tile records */
+} apmap_chipcfg_t;
+
+/*
+* A binary configuration file mapped into memory
+*/
+typedef struct {
+  int tile_size;    /* The # of STEs in a tile */
+  int tile_num;     /* The # of tiles in a chip */
+  int global_num;   /* The # of 1-way global switches */
+  int max_in;       /* The # of switch inputs of a tile */
+  size_t rowbytes;  /* Bytes in a bit row of a tile */
+  size_t tilebytes; /* Bytes in a packed tile record */
+  int nchip;
+  apmap_chipcfg_t *chip;
+  const char *data;
+  size_t length;
+} apmap_config_t;
+
+/*
+* Map a binary configuration file written by apmap --emit=binary.
+* Nothing is copied or parsed; all pointers refer into the mapping.
+* Unlike ApmapMapCC, it does not quit the process on an error: a file that
+* cannot be read or is not a valid configuration is reported on stderr,
+* and NULL is returned.
+*/
+apmap_config_t *ApmapOpenConfig(const char *file);
+
+/*
+* Locate tile *tile* of the *chip*-th chip in the file.
+* Returns 0, or -1 if the file has no such chip or tile.
+*/
+int ApmapGetTile(const apmap_config_t *cfg, int chip, int tile, apmap_tilecfg_t *out);
+
+/*
+* Unmap a binary configuration file
+*/
+void ApmapCloseConfig(apmap_config_t *cfg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -13,8 +13,10 @@
 #include <math.h>
 #include <assert.h>
 #include <getopt.h>
+#include <pthread.h>
 
 #include "metis.h"
+#include "apmap.h"
 #include "def.h"
 #include "struct.h"
 #include "proto.h"
@@ -9,29 +9,90 @@
 #ifndef _DEF_BIN_H_
 #define _DEF_BIN_H_
 
+/*
+* The geometry of the chips is set at run time, see geometry.c.
+* These are the values of the default geometry.
+*/
+#define DEF_TILE_NUM 128
+#define DEF_GLOBAL_NUM 4
+#define DEF_CHIP_NUM 2
+#define DEF_TILE_SIZE 256
+#define DEF_THRESHOLD 25
+#define DEF_G4_WIDTH 8
+
 /* The number of tiles in a chip */
-#define TILE_NUM 128
+#define TILE_NUM (geom.tile_num)
 
 /* The number of global switches in a chip */
-#define GLOBAL_NUM 4
+#define GLOBAL_NUM (geom.global_num)
 
 /* The number of chips in a system */
-#define CHIP_NUM 2
+#define CHIP_NUM (geom.chip_num)
 
 /* The number of STEs in a tile */
-#define TILE_SIZE 256
+#define TILE_SIZE (geom.tile_size)
 
 /*
 * Parameter used for unbalanced mapping. If the number of remaining STEs in a tile is
 * less than the THRESHOLD, then these STEs will not be used. The mapping of other large
 * graphs will start from the next tile.
 */
-#define THRESHOLD 25
+#define THRESHOLD (geom.threshold)
+
+/* The number of outputs of a tile that the 4-way global switch takes */
+#define G4_WIDTH (geom.g4_width)
+
+/*
+* Copies of a function for the default geometry are made by inlining it
+* with the DEF_* values; GCC does not always inline large functions.
+*/
+#ifdef __GNUC__
+#define GEOM_INLINE inline __attribute__((always_inline))
+#else
+#define GEOM_INLINE inline
+#endif
+
+/* Stride of the tail sizes sampled first by the guided partition search */
+#define TAIL_STRIDE 16
 
 /* The number of outgoing channels in a tile */
-#define MAX_OUT (GLOBAL_NUM * 2 + 8)
+#define MAX_OUT (GLOBAL_NUM * 2 + G4_WIDTH)
 
 /* The number of incoming channels in a tile */
-#define MAX_IN (GLOBAL_NUM * 2 + 8)
+#define MAX_IN (GLOBAL_NUM * 2 + G4_WIDTH)
+
+/* Magic bytes and version of the binary automaton format (.apg) */
+#define APG_MAGIC "APG\0"
+#define APG_VERSION 1
+
+/* Magic bytes and version of the bundled workload archive (.apb) */
+#define APB_MAGIC "APB\0"
+#define APB_VERSION 1
+
+/* Magic bytes and version of the binary configuration file (.apc) */
+#define APC_MAGIC "APC\0"
+#define APC_VERSION 1
+
+/* Magic bytes and version of a partition cache entry */
+#define PCACHE_MAGIC "APP\0"
+#define PCACHE_VERSION 2
+
+/* Graph partitioners */
+#define PARTITIONER_METIS 0
+#define PARTITIONER_NATIVE 1
+
+/* Shapes of a graph, see GraphShape */
+#define SHAPE_CHAIN 0
+#define SHAPE_TREE 1
+#define SHAPE_DAG 2
+#define SHAPE_CYCLIC 3
+
+/* Policies for filling the rest of a tile with small graphs */
+#define FILL_FFD 0  /* The largest graph that fits, first-fit decreasing */
+#define FILL_BEST 1 /* Every small graph to the open tile it fits most tightly, best-fit decreasing */
+
+/* Formats of the mapping result */
+#define EMIT_TEXT 1
+#define EMIT_BINARY 2
 
 #endif
@@ -9,30 +9,107 @@
 #ifndef _PROTOBIN_H_
 #define _PROTOBIN_H_
 
+/* apg.c */
+void ParseApgBuffer(graph_t *graph, const char *buf, size_t size, const char *file,
+                    int nvtxs, int nedges);
+void ReadApgFile(graph_t *graph, const char *file, int nvtxs, int nedges);
+long WriteApgStream(graph_t *graph, FILE *fpout);
+void WriteApgFile(graph_t *graph, const char *file);
+
+/* ahead.c */
+void PartitionAhead(automata_t *automata, int ngraph, int maxedge, mapopt_t *opt);
+
+/* apc.c */
+void WriteApcFile(chip_t *chip, int nchip, const char *file);
+
+/* arena.c */
+arena_t *CreateArena(unsigned size);
+unsigned ArenaAdd(arena_t *arena, const char *str, unsigned len);
+const char *ArenaGet(arena_t *arena, unsigned off);
+void ResetArena(arena_t *arena);
+void FreeArena(arena_t *arena);
+
+/* bundle.c */
+automata_t *ReadBundleIndex(FILE *fpin, int *ngraph);
+void WriteBundleIndex(FILE *fpout, apb_entry_t *entry, int ngraph);
+
+/* cache.c */
+unsigned long long StructHash(graph_t *graph);
+void PartitionKey(graph_t *graph, int headsize, int has_g4, mapopt_t *opt,
+                  unsigned long long key[2]);
+char LoadPartition(const char *dir, unsigned long long key[2], graph_t *graph,
+                   graph_t *ungraph, list_t *choice);
+void StorePartition(const char *dir, unsigned long long key[2], graph_t *graph,
+                    graph_t *ungraph, list_t *choice);
+classtab_t *CreateClassTable(void);
+char LookupClass(classtab_t *tab, graph_t *graph, graph_t *ungraph, int headsize,
+                 list_t *choice);
+char HasClass(classtab_t *tab, graph_t *graph, int headsize);
+void AddClass(classtab_t *tab, graph_t *graph, graph_t *ungraph, int headsize,
+              list_t *choice);
+void FreeClassTable(classtab_t *tab);
+
 /* chip.c */
 void ChipInit(chip_t *chip, char has_g4);
-char MapGraphToChip(chip_t *chip, graph_t *graph, graph_t *ungraph, int no_opt);
-void EmitChip(chip_t *chip, FILE* fp);
+char MapLargeGraph(chip_t *chip, graph_t *graph, char use);
+char MapGraphToChip(chip_t *chip, graph_t *graph, graph_t *ungraph, mapopt_t *opt);
+void EmitChips(chip_t *chip, int nchip, mapopt_t *opt, const char *outfile);
 void FreeChip(chip_t *chip);
 
+/* fill.c */
+fillidx_t *CreateFillIndex(automata_t *automata, const int *idx, int n);
+void RemoveFillIndex(fillidx_t *fi, int pos);
+int NextUnmapped(fillidx_t *fi, int pos);
+int LargestFit(fillidx_t *fi, int room);
+void FreeFillIndex(fillidx_t *fi);
+roomidx_t *CreateRoomIndex(chip_t *chip, int nchip);
+void AddRoom(roomidx_t *ri, int k, int tile, int room);
+int TightestRoom(roomidx_t *ri, int size, int *k, int *tile);
+void FreeRoomIndex(roomidx_t *ri);
+
+/* geometry.c */
+extern geometry_t geom;
+void ParseGeometry(const char *text, const char *source);
+void LoadGeometry(const char *file);
+
 /* global.c */
 void InitGlobal(global_t *global);
+void FreeGlobal(global_t *global);
 char MapGlobal(chip_t *chip, graph_t *graph, int *curtile);
-void CopyGlobal(global_t dest[GLOBAL_NUM], global_t src[GLOBAL_NUM]);
-void CopyG4(g4_t *dest, g4_t *src);
-void EmitGlobal(global_t global[GLOBAL_NUM], tile_t tile[TILE_NUM], FILE *fp);
-void EmitG4(g4_t *g4, tile_t tile[TILE_NUM], FILE *fp);
+void EmitGlobal(global_t *global, int index, tile_t *tile, char compact, outbuf_t *out);
+void EmitG4(g4_t *g4, tile_t *tile, char compact, outbuf_t *out);
+int CollectRoutes(chip_t *chip, apmap_route_t **route);
 
 /* graph.c */
 graph_t *CreateGraph(int nvtxs, int nedges, char extra);
 void FreeGraph(graph_t **r_graph, int nvtxs);
-void *GetUndiGraph(graph_t *digraph, graph_t *graph);
+void GetUndiGraph(graph_t *digraph, graph_t *graph);
 void CountBoundaryNodes(graph_t* graph, int *nin, int *nout);
+void CountBoundary(graph_t *graph, const int *where, int npart, int *nin, int *nout, int *mark);
 void InsertDuplicate(graph_t *graph, int pos, int num);
 
+/* mapper.c */
+int CompAutomata(const void *a, const void *b);
+void InitMapOpt(mapopt_t *opt);
+float MapAutomata(automata_t *automata, int ngraph, mapopt_t *opt, const char *outfile);
+
 /* parser.c */
 automata_t *ReadMapFile(FILE *fpin, int *ngraph);
 void ReadGraphFile(graph_t *graph, const char *file, int nvtxs, int nedges);
+const char *MapFile(const char *file, size_t *size);
+const char *TryMapFile(const char *file, size_t *size);
+void UnmapFile(const char *buf, size_t size);
+void ParseGraphBuffer(graph_t *graph, const char *buf, size_t size, const char *file,
+                      int nvtxs, int nedges);
+void MmapGraphFile(graph_t *graph, const char *file, int nvtxs, int nedges);
+void LoadGraph(graph_t *graph, automata_t *automata, graphreader_t readtext);
+
+/* journal.c */
+void InitJournal(journal_t *log);
+void JournalSet(journal_t *log, int *addr, int value);
+void CommitJournal(journal_t *log);
+void RollbackJournal(journal_t *log);
+void FreeJournal(journal_t *log);
 
 /* list.c */
 list_t *CreateList(int size);
@@ -47,21 +124,52 @@ void PrintList(list_t *list);
 void EmptyList(list_t *list);
 void FreeList(list_t *list);
 
+/* multilevel.c */
+char NativePartition(graph_t *ungraph, graph_t *graph, int npart, int headsize, int tailsize,
+                     char has_g4, int *part);
+
+/* outbuf.c */
+void InitOutBuf(outbuf_t *out, FILE *fp, size_t size);
+void FlushOutBuf(outbuf_t *out);
+void BufPutStr(outbuf_t *out, const char *str);
+void BufPutInt(outbuf_t *out, int num);
+void BufPutUnsigned(outbuf_t *out, unsigned num);
+void BufPutHex(outbuf_t *out, unsigned num);
+void FreeOutBuf(outbuf_t *out);
+
 /* partition.c */
 void SetPartSizeTarget(float *tpwgts, int npart, int minsize);
 int CalcBoundaryOverhead(int *nin, int *nout, int npart, char has_g4);
+char CheckPartSize(const int *part, int nvtxs, int npart, int headsize);
+void ParallelMetis(char on);
 void WritePartitionToFile(const char* fname, int *part, int n);
-char PartitionGraph(graph_t *ungraph, graph_t *graph, int remain, list_t *choice, int has_g4, int no_opt);
-void RePartitionGraph(graph_t *ungraph, graph_t *graph, list_t *choice, char has_g4);
+char PartitionGraph(graph_t *ungraph, graph_t *graph, int remain, list_t *choice, int has_g4,
+                    mapopt_t *opt);
+void RePartitionGraph(graph_t *ungraph, graph_t *graph, list_t *choice, char has_g4,
+                      mapopt_t *opt);
+
+/* prefetch.c */
+prefetch_t *CreatePrefetch(automata_t *automata, int ngraph, graphreader_t readtext,
+                           int depth, int nthreads, int nvtxs, int nedges, arena_t *names);
+void PrefetchGraph(prefetch_t *pf, int index, graph_t *graph);
+void FreePrefetch(prefetch_t *pf);
+
+/* refine.c */
+void RefinePartition(graph_t *ungraph, graph_t *graph, int npart, const int *cap, char has_g4,
+                     int *where);
+
+/* shape.c */
+int GraphShape(graph_t *graph, int *order);
+char ShapePartition(graph_t *graph, int headsize, char has_g4, int *npart);
 
 /* tile.c */
 void ResetTile(tile_t *tile);
 void InitTile(tile_t *tile, char has_g4);
-void ResolveConstraint(tile_t* tile, graph_t *graph, char has_g4);
+void ResolveConstraint(tile_t* tile, graph_t *graph, char has_g4, journal_t *log);
 void MapTile(tile_t *tile, graph_t *graph, int *remain);
 void CopyGraphToTile(chip_t *chip, graph_t *graph, int curtile);
 void CopySmallGraphToTile(tile_t *tile, graph_t *graph);
-void EmitTile(tile_t *tile, FILE *fp);
+void EmitTile(tile_t *tile, arena_t *names, char compact, outbuf_t *out);
 void FreeTile(tile_t *tile);
 
 /* util.c */
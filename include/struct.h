@@ -15,6 +15,39 @@ typedef struct {
   int *value;
 } list_t;
 
+/*
+* The geometry of the chips, see def.h for the names used in the code
+*/
+typedef struct {
+  int tile_num;   /* The # of tiles in a chip */
+  int tile_size;  /* The # of STEs in a tile */
+  int global_num; /* The # of 1-way global switches in a chip */
+  int chip_num;   /* The # of chips in a system */
+  int threshold;  /* Below this # of free STEs a tile is given up */
+  int g4_width;   /* The # of outputs of a tile on the 4-way global switch */
+} geometry_t;
+
+/*
+* A growing buffer that stores strings back to back.
+* A string is referred to by the 32-bit offset of its first byte.
+*/
+typedef struct {
+  char *buf;
+  unsigned size;
+  unsigned maxsize;
+  pthread_mutex_t lock;
+} arena_t;
+
+/*
+* A text buffer for writing the mapping result with few write calls
+*/
+typedef struct {
+  char *buf;
+  size_t size;
+  size_t maxsize;
+  FILE *fp; /* The file that receives the text, or NULL to keep all of it */
+} outbuf_t;
+
 typedef struct {
   int nvtxs;	/* The # of vertices and edges in the graph */
   int npart;    /* The # of parts that the graph is divided into */
@@ -26,39 +59,242 @@ typedef struct {
   unsigned *ste; /* Array that stores the accepting characters of all the states */
   char *start; /* Array that stores whether a state is a start state */
   char *report; /* Array that stores whether a state is a final state */
-  char **name; /* Pointers to the STE names */
+  unsigned *nameoff; /* Offsets of the STE names in the arena, or numeric ids */
+  arena_t *names; /* The arena that stores the names. NULL if names are dropped */
+  unsigned long long shash; /* Hash of the structure (xadj and adjncy) */
   int cost;
+  char shaped;  /* Whether the partition was cut in topological order (ShapePartition) */
 
-  int *first;
-  int *current;
-  int *next;
-  int *from;
+  int *rxadj;   /* Scratch space of GetUndiGraph: predecessor lists */
+  int *radjncy;
+  int *mark;
 } graph_t;
 
+/* A function that fills a graph struct from a graph file */
+typedef void (*graphreader_t)(graph_t *graph, const char *file, int nvtxs, int nedges);
+
 typedef struct {
   int nstate;
   int nedge;
   char *fname;
+  const char *data; /* Content of the graph file if it is already in memory */
+  size_t length;    /* The # of bytes in data */
+  const apmap_cc_t *cc; /* The graph itself if it is handed over by a library call */
+  unsigned firstid; /* Numeric id of the first state when names are dropped */
   char mapped;
 } automata_t;
 
+/*
+* The partition of a class of structurally identical graphs
+*/
+typedef struct {
+  unsigned long long shash;
+  int headsize;
+  int nvtxs;
+  int *xadj;   /* Copy of the structure, to confirm a match */
+  int *adjncy;
+  int *where;
+  int npart;   /* graph->npart */
+  int upart;   /* ungraph->npart */
+  int cost;    /* graph->cost */
+  char shaped; /* graph->shaped */
+  list_t choice;
+} ccclass_t;
+
+/*
+* Open-addressing hash table of graph classes
+*/
+typedef struct {
+  ccclass_t **slot;
+  int nslot;   /* A power of 2 */
+  int ncls;
+  int nreuse;  /* The # of partitions reused */
+  pthread_mutex_t lock; /* The table may be shared by threads */
+} classtab_t;
+
+/*
+* A level of the multilevel partitioner, with weighted vertices and edges
+*/
+typedef struct {
+  int nvtxs;
+  int *xadj;
+  int *adjncy;
+  int *adjwgt;
+  int *vwgt;   /* The # of states in every vertex */
+  int *cmap;   /* The vertex of the next coarser level of every vertex */
+} mlgraph_t;
+
+/*
+* A move kept in the heap of the port overhead refinement
+*/
+typedef struct {
+  long long gain;
+  int vtx;
+  int ver;     /* Version of the state when the gain was computed */
+} fmmove_t;
+
+/*
+* State of the port overhead refinement of a partition
+*/
+typedef struct {
+  graph_t *graph;    /* The directed graph, whose boundary nodes are counted */
+  graph_t *ungraph;  /* The undirected graph, whose neighbors are move targets */
+  int npart;
+  const int *cap;    /* The largest size of every part */
+  char has_g4;
+  int *where;
+  int *size;
+  int *rxadj;        /* Predecessor lists of the directed graph */
+  int *radjncy;
+  int *nin;
+  int *nout;
+  long long scale;   /* Weight of the port overhead against the boundary nodes */
+  long long cost;
+  int *stamp;        /* Marks of parts and states, see tick, ptick and vtick */
+  int *pstamp;
+  int *vstamp;
+  int tick;
+  int ptick;
+  int vtick;
+  int *cand;         /* Scratch lists of parts and states */
+  int *aff;
+  fmmove_t *heap;    /* Max-heap of moves by gain */
+  int nheap;
+  int maxheap;
+  int *ver;          /* Version of the gain of every state */
+  char *locked;
+} portref_t;
+
+/*
+* Options of a mapping run
+*/
+typedef struct {
+  char has_g4;   /* Whether the 4-way global switch is used */
+  char no_opt;   /* Disable constraint conflict resolving optimizations */
+  graphreader_t readtext; /* Parser for text graph files */
+  int pfdepth;   /* The # of graphs parsed ahead, 0 disables prefetching */
+  int pfthreads; /* The # of prefetch threads */
+  char no_names; /* Replace STE names by numeric ids */
+  char compact;  /* Leave empty rows out of the mapping result */
+  char emit;     /* EMIT_TEXT and/or EMIT_BINARY */
+  int emitthreads; /* The # of threads that render the text result */
+  char split;    /* Write the text result of every chip to its own file */
+  int partthreads; /* The # of threads that try partitions of a large graph */
+  int seed;      /* Metis seed. -1 is the fixed default seed of Metis */
+  int nseed;     /* The # of seeds raced on every candidate, from seed up */
+  int nwin;      /* The # of races won by another seed than the first */
+  char partitioner; /* PARTITIONER_METIS or PARTITIONER_NATIVE */
+  char refine;   /* Refine Metis partitions on the port overhead */
+  char portbal;  /* Balance the port weights of the parts in Metis */
+  char exhaustive; /* Try every (npart, tailsize) candidate of a large graph */
+  int ncall;     /* The # of partitioner calls */
+  int nsaved;    /* The # of calls saved by the guided search */
+  char fastpath; /* Cut acyclic graphs in topological order when that is optimal */
+  int nfast;     /* The # of graphs partitioned that way */
+  char *cachedir; /* Directory of the partition cache, or NULL */
+  int cachehit;  /* Statistics of the partition cache */
+  int cachemiss;
+  char dedup;    /* Partition structurally identical graphs only once */
+  classtab_t *classes; /* Partitions of this run by graph structure */
+  char ahead;    /* Partition the large graphs in parallel before placing them */
+  char parchips; /* Divide the automata between the chips and map them in parallel */
+  char fill;     /* FILL_FFD or FILL_BEST */
+  classtab_t *aheadtab; /* Partitions computed ahead, or NULL */
+} mapopt_t;
+
+/*
+* The large graphs that threads partition ahead of the placement
+*/
+typedef struct {
+  automata_t *automata; /* The sorted automata, large ones first */
+  int ngraph;  /* The # of large graphs */
+  int maxedge;
+  mapopt_t *opt;
+  int inner;   /* The # of partition threads of every graph */
+  classtab_t *tab; /* Receives the partitions */
+  int next;    /* The next graph to be partitioned */
+  pthread_mutex_t lock;
+} aheadpool_t;
+
+/*
+* One run of the partitioner on a candidate, with one of the raced seeds
+*/
+typedef struct {
+  int seed;
+  char valid;  /* Result of MetisWrapper */
+  int cost;    /* Boundary overhead, only set if valid is 1 */
+  int *where;
+} seedrun_t;
+
+/*
+* A (npart, tailsize) candidate tried while partitioning a large graph
+*/
+typedef struct {
+  int npart;
+  int tailsize;
+  char valid;  /* Result of MetisWrapper */
+  int cost;    /* Boundary overhead, only set if valid is 1 */
+  int *where;  /* The partition found by Metis, owned by run[] */
+  int seed;    /* The seed that found it */
+  seedrun_t *run; /* One run per raced seed */
+} parcand_t;
+
+/*
+* A batch of candidates that are evaluated by several threads
+*/
+typedef struct {
+  graph_t *ungraph;
+  graph_t *graph;
+  int headsize;
+  char has_g4;
+  int seed;    /* Metis seed */
+  int nrun;    /* The # of seeds raced on every candidate */
+  int nwin;    /* The # of races won by another seed than the first */
+  char partitioner; /* PARTITIONER_METIS or PARTITIONER_NATIVE */
+  int *vwgt;   /* Metis vertex weights of the port balance, or NULL */
+  parcand_t *cand;
+  int ncand;
+  int next;    /* The next candidate to be evaluated */
+  pthread_mutex_t lock;
+} sweep_t;
+
+/*
+* A bounded set of graph buffers that worker threads fill ahead of the mapper
+*/
+typedef struct {
+  automata_t *automata; /* Automata in the order they are mapped */
+  int ngraph;
+  graphreader_t readtext; /* Parser for text graph files */
+  int depth;        /* The # of graph buffers */
+  int nthreads;     /* The # of worker threads */
+  graph_t **slot;   /* Graph buffers */
+  int *index;       /* The automaton held by each buffer, -1 if free */
+  char *ready;      /* Whether each buffer has been completely parsed */
+  char *taken;      /* Whether an automaton has been handed to the mapper */
+  int next;         /* The next automaton to be parsed */
+  char stop;
+  pthread_t *thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} prefetch_t;
+
 /*
 * Represent a tile that consists of an STE array and a local switch
 */
 typedef struct {
   int nstate;           /* Number of states */
-  int state[TILE_SIZE]; /* The Id of the states */
-  int xadj[TILE_SIZE + MAX_IN + 1]; /* The pointer to adjncy array. 
+  int *state; /* The Id of the states, TILE_SIZE of them */
+  int *xadj; /* The pointer to adjncy array, TILE_SIZE + MAX_IN + 1 entries.
                     xadj and adjncy together store the local graph */
   int *adjncy; /* This array contains the ending points of the transistions */
 
   list_t out;
-  char *sname[TILE_SIZE];
-  unsigned ste[TILE_SIZE][8];
-  char start[TILE_SIZE];
-  char report[TILE_SIZE];
-  int global[GLOBAL_NUM][2];
-  int *g4;
+  unsigned *sname; /* Arena offsets of the STE names, or numeric ids */
+  unsigned (*ste)[8];
+  char *start;
+  char *report;
+  int (*global)[2]; /* GLOBAL_NUM pairs */
+  int *g4;          /* G4_WIDTH entries */
   list_t *ghost;
   char duplicated;
 } tile_t;
@@ -67,27 +303,190 @@ typedef struct {
 * Represent a 1-way global switch
 */
 typedef struct {
-  int src[TILE_NUM][2]; /* The index of the input row */
+  int (*src)[2]; /* The index of the input row, for TILE_NUM tiles */
 } global_t;
 
 /*
 * Represent a 4-way global switch
 */
 typedef struct {
-  int src[TILE_NUM][8]; /* The index of the input row */
+  int *src; /* The index of the input row, G4_WIDTH per tile */
 } g4_t;
 
+/*
+* The old value of an entry that a mapping attempt changed
+*/
+typedef struct {
+  int *addr;
+  int old;
+} undo_t;
+
+/*
+* Undo log of a mapping attempt, see journal.c
+*/
+typedef struct {
+  undo_t *entry;
+  int size;
+  int maxsize;
+} journal_t;
+
 /*
 * Represent an Automata Processor
 */
 typedef struct {
-  global_t global[GLOBAL_NUM]; /* Global switches (1 way) */
-  tile_t tile[TILE_NUM];       /* Tiles */
+  global_t *global; /* Global switches (1 way), GLOBAL_NUM of them */
+  tile_t *tile;     /* Tiles, TILE_NUM of them */
   g4_t *g4;                    /* Global switches (4 ways) */
+  arena_t *names; /* The arena of STE names. NULL if numeric ids are emitted */
   int curtile; /* Id of the tile that is ready for mapping the next automata */
   int remain;  /* The number of STEs remaining unused in curtile */
+  journal_t journal; /* Changes of the mapping attempt in progress */
 } chip_t;
 
+/*
+* Index of the automata of a stream that are not mapped yet, see fill.c
+*/
+typedef struct {
+  int n;
+  int nleft;  /* The # of unmapped automata */
+  int logn;   /* The smallest power of 2 above n is 1 << logn */
+  int *tree;  /* Fenwick tree over the positions, 1 for an unmapped one */
+  int *first; /* first[s] is the first position with at most s states */
+} fillidx_t;
+
+/*
+* Index of the tiles that small graphs can still go to, by their # of free
+* states, see fill.c
+*/
+typedef struct {
+  int n;        /* The largest # of free states, TILE_SIZE */
+  int nopen;    /* The # of open tiles */
+  int logn;     /* The smallest power of 2 above n is 1 << logn */
+  int *tree;    /* Fenwick tree over the # of free states, r at position r - 1 */
+  list_t *open; /* open[r - 1]: chip * TILE_NUM + tile of the open tiles with r free states */
+} roomidx_t;
+
+/*
+* The share of the automata that one thread maps to one chip
+*/
+typedef struct {
+  automata_t *automata; /* All automata, sorted by size */
+  int *idx;    /* The automata of this chip, in order */
+  int n;
+  chip_t *chip;
+  prefetch_t *prefetch;
+  int maxedge;
+  mapopt_t opt; /* Copy of the options that collects the statistics of this chip */
+  int nfail;   /* The # of automata that did not fit on the chip */
+} chipjob_t;
+
+/*
+* A piece of the mapping result that is rendered on its own
+*/
+typedef struct {
+  chip_t *chip;
+  int sw;       /* The global switch to render (GLOBAL_NUM for the 4-way one), or -1 */
+  int tile;     /* The tile to render if sw is -1 */
+  outbuf_t out; /* The rendered text */
+} emitjob_t;
+
+/*
+* The emit jobs shared by the rendering threads
+*/
+typedef struct {
+  emitjob_t *job;
+  int njob;
+  int next;     /* The next job to be rendered */
+  char compact;
+  pthread_mutex_t lock;
+} emitpool_t;
+
+/*
+* Header of a binary automaton file (.apg). It is followed by these sections,
+* all in native byte order:
+*   int xadj[nvtxs+1], int adjncy[nedges], unsigned ste[nvtxs][8],
+*   char start[nvtxs], char report[nvtxs], unsigned nameoff[nvtxs],
+*   char strtab[strsize]
+* nameoff[i] is the offset of the NUL-terminated name of state i in strtab.
+*/
+typedef struct {
+  char magic[4];
+  unsigned version;
+  unsigned nvtxs;
+  unsigned nedges;
+  unsigned strsize;
+  unsigned reserved;
+} apg_header_t;
+
+/*
+* Header of a bundled workload archive (.apb). It is followed by *ngraph*
+* index entries and then by the graph files themselves, each of which may
+* be in the text or the binary format.
+*/
+typedef struct {
+  char magic[4];
+  unsigned version;
+  unsigned ngraph;
+  unsigned reserved;
+} apb_header_t;
+
+/*
+* Index entry of a bundled graph. *offset* counts from the start of the archive.
+*/
+typedef struct {
+  unsigned nstate;
+  unsigned nedge;
+  unsigned long long offset;
+  unsigned long long length;
+} apb_entry_t;
+
+/*
+* Header of a binary configuration file (.apc). It is followed by *nchip*
+* index entries. The configuration of a chip starts at its *offset*:
+*   apmap_route_t route[nroute], then ntile packed tile records.
+* A tile record holds, in this order:
+*   unsigned ste[tile_size][8], the local switch bit matrix of
+*   (tile_size + max_in) rows, and the start, report and used bit rows.
+* A bit row has tile_size bits, so a record keeps 4-byte alignment.
+*/
+typedef struct {
+  char magic[4];
+  unsigned version;
+  unsigned nchip;
+  unsigned tile_size;
+  unsigned tile_num;
+  unsigned global_num;
+  unsigned max_in;
+  unsigned reserved;
+} apc_header_t;
+
+/*
+* Index entry of a chip in a binary configuration file
+*/
+typedef struct {
+  unsigned id;
+  unsigned ntile;
+  unsigned has_g4;
+  unsigned nroute;
+  unsigned long long offset;
+} apc_chip_t;
+
+/*
+* Header of a partition cache entry. It is followed by
+*   int where[nvtxs], int choice[nchoice]
+*/
+typedef struct {
+  char magic[4];
+  unsigned version;
+  unsigned long long key; /* The second half of the cache key */
+  int nvtxs;
+  int npart;   /* graph->npart */
+  int upart;   /* ungraph->npart */
+  int cost;    /* graph->cost */
+  int nchoice; /* The # of values in the fallback choice list, 3 per choice */
+  int reserved;
+} pcache_header_t;
+
 typedef struct linkedlist {
   int value;
   struct linkedlist *next;
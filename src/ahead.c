@@ -0,0 +1,115 @@
+/*
+* Copyright (c) 2019, Delft University of Technology
+*
+* ahead.c
+*
+* Partitioning the large graphs in parallel before they are placed.
+* The head size of a graph depends on the placements before it, so only
+* the head size of a fresh tile is tried; that is the one a large graph
+* gets whenever the small graphs have filled up the previous tile.
+*/
+#include "apmapbin.h"
+
+/*
+* Worker of the ahead pool. Take the next large graph that nobody has
+* taken yet, largest first, and partition it.
+*/
+static void *AheadWorker(void *arg)
+{
+  aheadpool_t *pool = (aheadpool_t*)arg;
+  automata_t *automata = pool->automata;
+  graph_t *graph = CreateGraph(automata[0].nstate, pool->maxedge, 1);
+  graph_t *ungraph = CreateGraph(automata[0].nstate, pool->maxedge * 2, 0);
+  mapopt_t opt = *pool->opt;
+  list_t choice;
+  int index;
+
+  opt.partthreads = pool->inner;
+  opt.classes = NULL;
+  opt.aheadtab = NULL;
+  opt.ncall = opt.nsaved = opt.nwin = opt.nfast = 0;
+  opt.cachehit = opt.cachemiss = 0;
+  InitList(&choice, 4);
+
+  while (1) {
+    pthread_mutex_lock(&pool->lock);
+    index = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+    if (index >= pool->ngraph) {
+      break;
+    }
+
+    /* The names are not needed for partitioning */
+    LoadGraph(graph, &automata[index], pool->opt->readtext);
+    if (pool->opt->dedup && HasClass(pool->tab, graph, TILE_SIZE)) {
+      continue;
+    }
+
+    GetUndiGraph(graph, ungraph);
+    PartitionGraph(ungraph, graph, TILE_SIZE, &choice, pool->opt->has_g4, &opt);
+    AddClass(pool->tab, graph, ungraph, TILE_SIZE, &choice);
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->opt->ncall += opt.ncall;
+  pool->opt->nsaved += opt.nsaved;
+  pool->opt->nwin += opt.nwin;
+  pool->opt->nfast += opt.nfast;
+  pool->opt->cachehit += opt.cachehit;
+  pool->opt->cachemiss += opt.cachemiss;
+  pthread_mutex_unlock(&pool->lock);
+
+  free(choice.value);
+  FreeGraph(&graph, automata[0].nstate);
+  FreeGraph(&ungraph, automata[0].nstate);
+  return NULL;
+}
+
+/*
+* Partition the large graphs among the sorted automata with
+* opt->partthreads threads, the calling thread included, and keep the
+* partitions in opt->aheadtab. PartitionGraph takes a partition from
+* there when a graph starts on a fresh tile; it is the same partition as
+* it would compute itself. Graphs are handed out one at a time, so a
+* thread that is done with a small graph takes the next one. With fewer
+* than two threads nothing is done ahead, as it would not save any time.
+*/
+void PartitionAhead(automata_t *automata, int ngraph, int maxedge, mapopt_t *opt)
+{
+  aheadpool_t pool;
+  pthread_t *thread;
+  int nthreads;
+  int i;
+
+  pool.ngraph = 0;
+  while (pool.ngraph < ngraph && automata[pool.ngraph].nstate > TILE_SIZE) {
+    pool.ngraph++;
+  }
+  nthreads = (opt->partthreads < pool.ngraph)? opt->partthreads: pool.ngraph;
+  if (nthreads < 2) {
+    return;
+  }
+
+  pool.automata = automata;
+  pool.maxedge = maxedge;
+  pool.opt = opt;
+  pool.inner = opt->partthreads / nthreads;
+  pool.next = 0;
+  pool.tab = opt->aheadtab = CreateClassTable();
+  pthread_mutex_init(&pool.lock, NULL);
+
+  thread = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+  ParallelMetis(1);
+  for (i=1; i<nthreads; i++) {
+    if (pthread_create(&thread[i], NULL, AheadWorker, &pool) != 0) {
+      errexit("Cannot create partition thread %d!\n", i);
+    }
+  }
+  AheadWorker(&pool);
+  for (i=1; i<nthreads; i++) {
+    pthread_join(thread[i], NULL);
+  }
+  ParallelMetis(0);
+  free(thread);
+  pthread_mutex_destroy(&pool.lock);
+}
@@ -0,0 +1,241 @@
+/*
+* Copyright (c) 2019, Delft University of Technology
+*
+* apc.c
+*
+* Functions related to the binary configuration file (.apc)
+*/
+#include "apmapbin.h"
+
+/* Bytes in a bit row and in a packed tile record */
+#define APC_ROWBYTES(tile_size) ((size_t)(tile_size) / 8)
+#define APC_TILEBYTES(tile_size, max_in) \
+  ((size_t)(tile_size) * 8 * sizeof(unsigned) \
+   + ((size_t)(tile_size) + (max_in) + 3) * APC_ROWBYTES(tile_size))
+
+/*
+* Set bit *c* of a bit row
+*/
+static void SetBit(unsigned char *row, int c)
+{
+  row[c / 8] |= 1 << (c % 8);
+}
+
+/*
+* Pack the configuration of a tile into a zeroed tile record.
+* The local switch holds exactly the transitions listed in the text output.
+*/
+static void PackTile(tile_t *tile, unsigned char *rec)
+{
+  size_t rowbytes = APC_ROWBYTES(TILE_SIZE);
+  unsigned char *local = rec + TILE_SIZE * 8 * sizeof(unsigned);
+  unsigned char *start = local + (TILE_SIZE + MAX_IN) * rowbytes;
+  unsigned char *report = start + rowbytes;
+  unsigned char *used = report + rowbytes;
+  int nrow = (tile->g4 != NULL)? TILE_SIZE + MAX_IN: TILE_SIZE + 2 * GLOBAL_NUM;
+  int i, j;
+
+  memcpy(rec, tile->ste, TILE_SIZE * 8 * sizeof(unsigned));
+  for (i=0; i<nrow; i++) {
+    if (i < TILE_SIZE && tile->state[i] == -1) {
+      continue;
+    }
+    for (j=tile->xadj[i]; j<tile->xadj[i+1]; j++) {
+      SetBit(local + i * rowbytes, tile->adjncy[j]);
+    }
+  }
+  for (i=0; i<TILE_SIZE; i++) {
+    if (tile->state[i] != -1) {
+      SetBit(used, i);
+      if (tile->start[i]) {
+        SetBit(start, i);
+      }
+      if (tile->report[i]) {
+        SetBit(report, i);
+      }
+    }
+  }
+}
+
+/*
+* Write the configuration of all used chips to a binary configuration file
+*/
+void WriteApcFile(chip_t *chip, int nchip, const char *file)
+{
+  size_t tilebytes = APC_TILEBYTES(TILE_SIZE, MAX_IN);
+  unsigned char *rec = (unsigned char*)malloc(tilebytes);
+  apc_header_t header;
+  apc_chip_t *entry;
+  apmap_route_t *route;
+  unsigned long long offset;
+  FILE *fp;
+  char ok;
+  int nused;
+  int i, j;
+
+  fp = fopen(file, "wb");
+  if (!fp) {
+    errexit("Cannot open file %s!\n", file);
+  }
+
+  entry = (apc_chip_t*)calloc(nchip, sizeof(apc_chip_t));
+  for (nused=0, i=0; i<nchip; i++) {
+    if (chip[i].curtile>0 || chip[i].remain<TILE_SIZE) {
+      entry[nused].id = i;
+      entry[nused].ntile = chip[i].curtile + (chip[i].remain < TILE_SIZE);
+      entry[nused].has_g4 = chip[i].g4 != NULL;
+      nused++;
+    }
+  }
+
+  memset(&header, 0, sizeof(apc_header_t));
+  memcpy(header.magic, APC_MAGIC, 4);
+  header.version = APC_VERSION;
+  header.nchip = nused;
+  header.tile_size = TILE_SIZE;
+  header.tile_num = TILE_NUM;
+  header.global_num = GLOBAL_NUM;
+  header.max_in = MAX_IN;
+  ok = fwrite(&header, sizeof(apc_header_t), 1, fp) == 1;
+  ok = ok && fwrite(entry, sizeof(apc_chip_t), nused, fp) == (size_t)nused;
+  offset = sizeof(apc_header_t) + nused * sizeof(apc_chip_t);
+
+  for (i=0; ok && i<nused; i++) {
+    entry[i].offset = offset;
+
+    /* Global switches are only used by graphs that span several tiles */
+    if (chip[entry[i].id].curtile > 0) {
+      entry[i].nroute = CollectRoutes(&chip[entry[i].id], &route);
+      ok = fwrite(route, sizeof(apmap_route_t), entry[i].nroute, fp) == entry[i].nroute;
+      free(route);
+    }
+    offset += entry[i].nroute * sizeof(apmap_route_t);
+
+    for (j=0; ok && j<(int)entry[i].ntile; j++) {
+      memset(rec, 0, tilebytes);
+      PackTile(&chip[entry[i].id].tile[j], rec);
+      ok = fwrite(rec, 1, tilebytes, fp) == tilebytes;
+    }
+    offset += entry[i].ntile * tilebytes;
+  }
+
+  /* Fill in the index now that the offsets are known */
+  ok = ok && fseek(fp, sizeof(apc_header_t), SEEK_SET) == 0;
+  ok = ok && fwrite(entry, sizeof(apc_chip_t), nused, fp) == (size_t)nused;
+  ok = (fclose(fp) == 0) && ok;
+  if (!ok) {
+    errexit("Cannot write file %s!\n", file);
+  }
+  free(entry);
+  free(rec);
+}
+
+/*
+* Check the header and the chip index of a mapped configuration file and
+* fill in *cfg*. A problem is reported on stderr and 0 is returned.
+*/
+static char ReadConfigIndex(apmap_config_t *cfg, const char *file)
+{
+  const apc_header_t *header;
+  const apc_chip_t *entry;
+  unsigned long long size;
+  int i;
+
+  if (cfg->length < sizeof(apc_header_t)) {
+    fprintf(stderr, "%s is not a binary configuration file.\n", file);
+    return 0;
+  }
+  header = (const apc_header_t*)cfg->data;
+  if (memcmp(header->magic, APC_MAGIC, 4) != 0) {
+    fprintf(stderr, "%s is not a binary configuration file.\n", file);
+    return 0;
+  }
+  if (header->version != APC_VERSION) {
+    fprintf(stderr, "%s has version %u, but only version %d is supported.\n",
+            file, header->version, APC_VERSION);
+    return 0;
+  }
+  if (header->tile_size == 0 || header->tile_size % 32 != 0) {
+    fprintf(stderr, "Unsupported tile size %u in %s.\n", header->tile_size, file);
+    return 0;
+  }
+  if (cfg->length < sizeof(apc_header_t) + (size_t)header->nchip * sizeof(apc_chip_t)) {
+    fprintf(stderr, "Premature end of binary configuration file %s.\n", file);
+    return 0;
+  }
+
+  cfg->tile_size = header->tile_size;
+  cfg->tile_num = header->tile_num;
+  cfg->global_num = header->global_num;
+  cfg->max_in = header->max_in;
+  cfg->rowbytes = APC_ROWBYTES(header->tile_size);
+  cfg->tilebytes = APC_TILEBYTES(header->tile_size, header->max_in);
+  cfg->nchip = header->nchip;
+  cfg->chip = (apmap_chipcfg_t*)malloc((cfg->nchip + 1) * sizeof(apmap_chipcfg_t));
+
+  entry = (const apc_chip_t*)(cfg->data + sizeof(apc_header_t));
+  for (i=0; i<cfg->nchip; i++) {
+    size = entry[i].nroute * sizeof(apmap_route_t) + entry[i].ntile * cfg->tilebytes;
+    if (entry[i].offset % 4 != 0 || entry[i].offset > cfg->length ||
+        size > cfg->length - entry[i].offset || entry[i].ntile > header->tile_num) {
+      fprintf(stderr, "Chip %d is out of the binary configuration file %s.\n", i, file);
+      return 0;
+    }
+    cfg->chip[i].id = entry[i].id;
+    cfg->chip[i].ntile = entry[i].ntile;
+    cfg->chip[i].has_g4 = entry[i].has_g4;
+    cfg->chip[i].nroute = entry[i].nroute;
+    cfg->chip[i].route = (const apmap_route_t*)(cfg->data + entry[i].offset);
+    cfg->chip[i].tile = (const unsigned char*)(cfg->chip[i].route + entry[i].nroute);
+  }
+  return 1;
+}
+
+/*
+* Library entry point. Map a binary configuration file into memory.
+* Returns NULL if the file cannot be mapped or is not a valid one.
+*/
+apmap_config_t *ApmapOpenConfig(const char *file)
+{
+  apmap_config_t *cfg = (apmap_config_t*)malloc(sizeof(apmap_config_t));
+
+  cfg->chip = NULL;
+  cfg->data = TryMapFile(file, &cfg->length);
+  if (!ReadConfigIndex(cfg, file)) {
+    ApmapCloseConfig(cfg);
+    return NULL;
+  }
+  return cfg;
+}
+
+/*
+* Library entry point. Locate a tile record.
+* Returns 0, or -1 if there is no such tile.
+*/
+int ApmapGetTile(const apmap_config_t *cfg, int chip, int tile, apmap_tilecfg_t *out)
+{
+  const unsigned char *rec;
+
+  if (chip < 0 || chip >= cfg->nchip || tile < 0 || tile >= cfg->chip[chip].ntile) {
+    return -1;
+  }
+  rec = cfg->chip[chip].tile + tile * cfg->tilebytes;
+  out->ste = (const unsigned*)rec;
+  out->local = rec + cfg->tile_size * 8 * sizeof(unsigned);
+  out->start = out->local + (cfg->tile_size + cfg->max_in) * cfg->rowbytes;
+  out->report = out->start + cfg->rowbytes;
+  out->used = out->report + cfg->rowbytes;
+  return 0;
+}
+
+/*
+* Library entry point. Release a binary configuration file.
+*/
+void ApmapCloseConfig(apmap_config_t *cfg)
+{
+  if (cfg) {
+    UnmapFile(cfg->data, cfg->length);
+    free(cfg->chip);
+    free(cfg);
+  }
+}
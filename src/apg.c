@@ -0,0 +1,163 @@
+/*
+* Copyright (c) 2019, Delft University of Technology
+*
+* apg.c
+*
+* Functions related to the binary automaton format (.apg)
+*/
+
+#include "apmapbin.h"
+
+/*
+* Copy one section out of an .apg buffer, quit if the buffer is truncated
+*/
+static const char *ReadSection(void *ptr, size_t size, const char *cur, const char *end,
+                               const char *file)
+{
+  if ((size_t)(end - cur) < size) {
+    errexit("Premature end of binary graph file %s.\n", file);
+  }
+  memcpy(ptr, cur, size);
+  return cur + size;
+}
+
+/*
+* Decode the content of a binary graph file that is already in memory.
+* Every array of the graph struct is filled by a single bulk copy.
+* *file* is only used in error messages.
+*/
+void ParseApgBuffer(graph_t *graph, const char *buf, size_t size, const char *file,
+                    int nvtxs, int nedges)
+{
+  const char *cur = buf;
+  const char *end = buf + size;
+  const char *strtab;
+  apg_header_t header;
+  unsigned base;
+  int i;
+
+  cur = ReadSection(&header, sizeof(apg_header_t), cur, end, file);
+  if (memcmp(header.magic, APG_MAGIC, 4) != 0) {
+    errexit("%s is not a binary graph file.\n", file);
+  }
+  if (header.version != APG_VERSION) {
+    errexit("%s has version %u, but only version %d is supported.\n",
+            file, header.version, APG_VERSION);
+  }
+  if ((int)header.nvtxs != nvtxs || (int)header.nedges != nedges) {
+    errexit("%s contains %u states and %u edges, but the .map file specifies %d and %d.\n",
+            file, header.nvtxs, header.nedges, nvtxs, nedges);
+  }
+  graph->nvtxs = nvtxs;
+
+  cur = ReadSection(graph->xadj, (nvtxs + 1) * sizeof(int), cur, end, file);
+  cur = ReadSection(graph->adjncy, nedges * sizeof(int), cur, end, file);
+  cur = ReadSection(graph->ste, 8 * nvtxs * sizeof(unsigned), cur, end, file);
+  cur = ReadSection(graph->start, nvtxs, cur, end, file);
+  cur = ReadSection(graph->report, nvtxs, cur, end, file);
+
+  if (graph->xadj[0] != 0 || graph->xadj[nvtxs] != nedges) {
+    errexit("Corrupted adjacency index in %s.\n", file);
+  }
+  for (i=0; i<nvtxs; i++) {
+    if (graph->xadj[i] > graph->xadj[i+1]) {
+      errexit("Corrupted adjacency index of state %d in %s.\n", i, file);
+    }
+  }
+  for (i=0; i<nedges; i++) {
+    if (graph->adjncy[i] < 0 || graph->adjncy[i] >= nvtxs) {
+      errexit("Edge %d in %s is out of bounds\n", graph->adjncy[i] + 1, file);
+    }
+  }
+
+  /* Move the whole string table into the arena at once */
+  cur = ReadSection(graph->nameoff, nvtxs * sizeof(unsigned), cur, end, file);
+  strtab = cur;
+  if ((size_t)(end - strtab) < header.strsize ||
+      (header.strsize > 0 && strtab[header.strsize - 1] != '\0')) {
+    errexit("Corrupted string table in %s.\n", file);
+  }
+  for (i=0; i<nvtxs; i++) {
+    if (graph->nameoff[i] >= header.strsize) {
+      errexit("Name of state %d in %s is out of the string table\n", i, file);
+    }
+  }
+  if (graph->names) {
+    base = ArenaAdd(graph->names, strtab, header.strsize);
+    for (i=0; i<nvtxs; i++) {
+      graph->nameoff[i] += base;
+    }
+  }
+}
+
+/*
+* Read a binary graph file written by WriteApgFile
+*/
+void ReadApgFile(graph_t *graph, const char *file, int nvtxs, int nedges)
+{
+  size_t size;
+  const char *buf = MapFile(file, &size);
+
+  ParseApgBuffer(graph, buf, size, file, nvtxs, nedges);
+  UnmapFile(buf, size);
+}
+
+/*
+* Write a graph in the binary format to an open stream.
+* The graph must keep its names in an arena. Returns the # of bytes written.
+*/
+long WriteApgStream(graph_t *graph, FILE *fpout)
+{
+  int nvtxs = graph->nvtxs;
+  apg_header_t header;
+  unsigned *nameoff;
+  const char *name;
+  unsigned off;
+  int i;
+
+  nameoff = (unsigned*)malloc(nvtxs * sizeof(unsigned));
+  for (off=0, i=0; i<nvtxs; i++) {
+    nameoff[i] = off;
+    off += strlen(ArenaGet(graph->names, graph->nameoff[i])) + 1;
+  }
+
+  memset(&header, 0, sizeof(apg_header_t));
+  memcpy(header.magic, APG_MAGIC, 4);
+  header.version = APG_VERSION;
+  header.nvtxs = nvtxs;
+  header.nedges = graph->xadj[nvtxs];
+  header.strsize = off;
+
+  fwrite(&header, sizeof(apg_header_t), 1, fpout);
+  fwrite(graph->xadj, sizeof(int), nvtxs + 1, fpout);
+  fwrite(graph->adjncy, sizeof(int), header.nedges, fpout);
+  fwrite(graph->ste, sizeof(unsigned), 8 * nvtxs, fpout);
+  fwrite(graph->start, 1, nvtxs, fpout);
+  fwrite(graph->report, 1, nvtxs, fpout);
+  fwrite(nameoff, sizeof(unsigned), nvtxs, fpout);
+  for (i=0; i<nvtxs; i++) {
+    name = ArenaGet(graph->names, graph->nameoff[i]);
+    fwrite(name, 1, strlen(name) + 1, fpout);
+  }
+  free(nameoff);
+
+  return sizeof(apg_header_t) + (nvtxs + 1 + header.nedges) * sizeof(int)
+         + 8 * nvtxs * sizeof(unsigned) + 2 * nvtxs + nvtxs * sizeof(unsigned)
+         + header.strsize;
+}
+
+/*
+* Write a graph to a binary graph file
+*/
+void WriteApgFile(graph_t *graph, const char *file)
+{
+  FILE *fpout = fopen(file, "wb");
+
+  if (!fpout) {
+    errexit("Cannot open file \"%s\"!\n", file);
+  }
+  WriteApgStream(graph, fpout);
+  if (fclose(fpout) != 0) {
+    errexit("Cannot write file \"%s\"!\n", file);
+  }
+}
@@ -0,0 +1,141 @@
+/*
+* Copyright (c) 2019, Delft University of Technology
+*
+* apgconv.c
+*
+* Convert the text graph files listed in a map file to binary graph files,
+* or pack them into a single bundled archive
+*/
+#include "apmapbin.h"
+
+void PrintHelp(const char* filename)
+{
+  printf("usage: %s [options] input_map_file output_file\n", filename);
+  printf("Every graph file listed in the input map file is converted to a binary\n");
+  printf("graph file with the .apg extension. The output map file lists the new files.\n");
+  printf("Options:\n");
+  printf("\t-h or --help:\tprint this usage information.\n");
+  printf("\t--bundle:\twrite all binary graphs into one bundled archive (.apb) instead.\n");
+}
+
+/*
+* Derive the name of a binary graph file from the name of a text graph file
+*/
+char *ApgFileName(const char *fname)
+{
+  size_t len = strlen(fname);
+  char *apgname = (char*)malloc(len + 5);
+
+  strcpy(apgname, fname);
+  if (len > 6 && strcmp(fname + len - 6, ".graph") == 0) {
+    len -= 6;
+  }
+  strcpy(apgname + len, ".apg");
+  return apgname;
+}
+
+int main(int argc, char *argv[])
+{
+  automata_t *automata;
+  graph_t *graph;
+  apb_entry_t *entry;
+  int ngraph, maxstate, maxedge;
+  long offset = 0;
+  char *apgname;
+  FILE *fmap, *fout;
+  int i;
+
+  /* Variables for parsing the command-line */
+  static int bundle = 0;
+  static struct option long_options[] = {
+    {"bundle", no_argument, &bundle, 1},
+    {"help", no_argument, 0, 'h'},
+    {0, 0, 0, 0}
+  };
+  int c;
+  int option_index = 0;
+
+  while (1) {
+    c = getopt_long (argc, argv, "h", long_options, &option_index);
+    if (c == -1)
+      break;
+    switch (c) {
+      case 0: /* If this option set a flag, do nothing else now. */
+          break;
+      case 'h':
+        PrintHelp(argv[0]);
+        return 0;
+      case '?':
+        PrintHelp(argv[0]);
+        return 1;
+      default:
+        abort();
+    }
+  }
+  if (argc - optind != 2) {
+    PrintHelp(argv[0]);
+    return 1;
+  }
+
+  fmap = fopen(argv[optind], "r");
+  if (!fmap) {
+    errexit("Cannot open file %s!\n", argv[optind]);
+  }
+  automata = ReadMapFile(fmap, &ngraph);
+  fclose(fmap);
+
+  maxstate = 0;
+  maxedge = 0;
+  for (i=0; i<ngraph; i++) {
+    maxstate = (automata[i].nstate>maxstate)? automata[i].nstate: maxstate;
+    maxedge = (automata[i].nedge>maxedge)? automata[i].nedge: maxedge;
+  }
+  graph = CreateGraph(maxstate, maxedge, 1);
+  graph->names = CreateArena(maxstate * 8);
+
+  fout = fopen(argv[optind + 1], bundle? "wb": "w");
+  if (!fout) {
+    errexit("Cannot open file %s!\n", argv[optind + 1]);
+  }
+  entry = (apb_entry_t*)calloc(ngraph, sizeof(apb_entry_t));
+  if (bundle) {
+    WriteBundleIndex(fout, entry, ngraph);
+    offset = sizeof(apb_header_t) + ngraph * sizeof(apb_entry_t);
+  }
+  else {
+    fprintf(fout, "%d\n", ngraph);
+  }
+
+  for (i=0; i<ngraph; i++) {
+    LoadGraph(graph, &automata[i], MmapGraphFile);
+    if (bundle) {
+      entry[i].nstate = automata[i].nstate;
+      entry[i].nedge = automata[i].nedge;
+      entry[i].offset = offset;
+      entry[i].length = WriteApgStream(graph, fout);
+      offset += entry[i].length;
+    }
+    else {
+      apgname = ApgFileName(automata[i].fname);
+      WriteApgFile(graph, apgname);
+      fprintf(fout, "%d %d %s\n", automata[i].nstate, automata[i].nedge, apgname);
+      free(apgname);
+    }
+
+    ResetArena(graph->names);
+    free(automata[i].fname);
+  }
+
+  if (bundle) {
+    WriteBundleIndex(fout, entry, ngraph);
+  }
+  if (fclose(fout) != 0) {
+    errexit("Cannot write file %s!\n", argv[optind + 1]);
+  }
+
+  FreeArena(graph->names);
+  FreeGraph(&graph, maxstate);
+  free(automata);
+  free(entry);
+  return 0;
+}
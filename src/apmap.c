@@ -7,23 +7,6 @@
 */
 #include "apmapbin.h"
 
-/*
-* Compare the sizes of automata. Needed by qsort
-*/
-int CompAutomata(const void *a, const void *b)
-{
-  int sizea = ((automata_t*)a)->nstate;
-  int sizeb = ((automata_t*)b)->nstate;
-  int edgea = ((automata_t*)a)->nedge;
-  int edgeb = ((automata_t*)b)->nedge;
-  if (sizea == sizeb) {
-    return edgeb - edgea;
-  }
-  else {
-    return sizeb - sizea;
-  }
-}
-
 void PrintHelp(const char* filename)
 {
   printf("usage: %s [options] map_file1 [map_file2] ...\n", filename);
@@ -31,17 +14,54 @@ void PrintHelp(const char* filename)
   printf("\t-h or --help:\tprint this usage information.\n");
   printf("\t--no-g4:\texclude the 4-way global switch from the routing matrix.\n");
   printf("\t--no-opt:\tdisable constraint conflict resolving optimizations.\n");
+  printf("\t--geometry=SPEC:\tthe geometry of the chips as key=value items separated by commas,\n");
+  printf("\t\te.g. tiles=128,tile-size=256,globals=4,chips=2,threshold=25,g4-width=8\n");
+  printf("\t\t(the default). Keys that are left out keep their default values.\n");
+  printf("\t--geometry-file=FILE:\tread the geometry from FILE, in the same format.\n");
+  printf("\t--parser=mmap|legacy:\tchoose the graph file parser (default: mmap).\n");
+  printf("\t--prefetch=N:\tparse up to N upcoming graphs in the background (default: 4, 0 disables).\n");
+  printf("\t--prefetch-threads=N:\tthe # of background parsing threads (default: 2).\n");
+  printf("\t--no-names:\tdo not keep STE names; emit numeric ids instead.\n");
+  printf("\t--compact:\tleave empty rows out of the mapping result.\n");
+  printf("\t--emit=text|binary|both:\tformat of the mapping result (default: text).\n");
+  printf("\t\tThe binary configuration is written to map_result.apc.\n");
+  printf("\t--emit-threads=N:\tthe # of threads that render the text result (default: 4).\n");
+  printf("\t--split-chips:\twrite the text result of chip N to map_result.chipN.\n");
+  printf("\t--partition-threads=N:\tthe # of partitions of a large graph tried at once\n");
+  printf("\t\t(default: the # of processors). Each of their Metis calls runs in a process of\n");
+  printf("\t\tits own, so the result does not depend on N.\n");
+  printf("\t--partitioner=native|metis:\tthe graph partitioner (default: metis). The native one\n");
+  printf("\t\trefines partitions on the port overhead of the tiles instead of the edge cut.\n");
+  printf("\t--no-refine:\tuse the partitions of Metis as they are, without refining them\n");
+  printf("\t\ton the port overhead.\n");
+  printf("\t--balance-ports:\tlet Metis also balance the # of successors of the states\n");
+  printf("\t\tin every part, to spread likely out-states over the tiles.\n");
+  printf("\t--exhaustive:\ttry every tail size of a large graph instead of a guided search.\n");
+  printf("\t--no-fastpath:\tpartition acyclic graphs with Metis too, instead of cutting them\n");
+  printf("\t\tin topological order when that needs no extra ports.\n");
+  printf("\t--seed=N:\tthe Metis seed (default: -1, the fixed default seed of Metis).\n");
+  printf("\t--seeds=N:\trace N Metis seeds, from the --seed one up, on every partition and\n");
+  printf("\t\tkeep the cheapest (default: 1). Every seed is a Metis call of its own, so N\n");
+  printf("\t\tseeds cost N times the Metis work of one, shared by the partition threads.\n");
+  printf("\t--no-ahead:\tpartition every large graph when it is placed. By default, with two or\n");
+  printf("\t\tmore partition threads, the large graphs are first partitioned in parallel for a\n");
+  printf("\t\tfresh tile, the head size most of them are placed with.\n");
+  printf("\t--parallel-chips:\tdivide the automata between the chips up front and map\n");
+  printf("\t\tevery chip on its own thread. Reports at most how many tiles more than serial\n");
+  printf("\t\tfirst-fit this takes, measured against the lower bound of the tile count.\n");
+  printf("\t--fill=ffd|best:\thow the small graphs are placed. ffd (the default) fills the rest\n");
+  printf("\t\tof the last tile of every graph with the largest small graphs that fit. best places\n");
+  printf("\t\tthe large graphs first and then every small graph, largest first, in the tile with\n");
+  printf("\t\tthe fewest free states that it fits in.\n");
+  printf("\t--no-dedup:\tpartition every graph, even one identical in structure to an earlier one.\n");
+  printf("\t--partition-cache=DIR:\treuse the partitions of unchanged graphs stored in DIR.\n");
 }
 
 int main(int argc, char *argv[])
 {
   automata_t *automata; /* The array of input automata */
-  graph_t *graph, *ungraph;
-  int ngraph = 0, maxedge;
-  chip_t *chip;
-  int minauto, minautosize, candidate;
-  char succeed;
-  float ntile;
+  int ngraph = 0;
+  mapopt_t opt;
   int i, j, k;
 
   /* Variables for file reading */
@@ -52,15 +72,50 @@ int main(int argc, char *argv[])
   /* Variables for parsing the command-line */
   static int has_g4 = 1;
   static int no_opt = 0;
+  static int no_names = 0;
+  static int compact = 0;
+  static int split = 0;
+  static int dedup = 1;
+  static int refine = 1;
+  static int exhaustive = 0;
+  static int portbal = 0;
+  static int fastpath = 1;
+  static int ahead = 1;
+  static int parchips = 0;
   static struct option long_options[] = {
     {"no-g4", no_argument,       &has_g4, 0},
     {"no-opt",   no_argument,       &no_opt, 1},
+    {"no-names", no_argument,       &no_names, 1},
+    {"compact",  no_argument,       &compact, 1},
+    {"split-chips", no_argument,    &split, 1},
+    {"no-dedup", no_argument,       &dedup, 0},
+    {"no-refine", no_argument,      &refine, 0},
+    {"exhaustive", no_argument,     &exhaustive, 1},
+    {"balance-ports", no_argument,  &portbal, 1},
+    {"no-fastpath", no_argument,    &fastpath, 0},
+    {"no-ahead", no_argument,       &ahead, 0},
+    {"parallel-chips", no_argument, &parchips, 1},
+    {"parser", required_argument, 0, 'p'},
+    {"emit", required_argument, 0, 'e'},
+    {"emit-threads", required_argument, 0, 'E'},
+    {"partition-threads", required_argument, 0, 'M'},
+    {"partitioner", required_argument, 0, 'A'},
+    {"seed", required_argument, 0, 's'},
+    {"seeds", required_argument, 0, 'S'},
+    {"partition-cache", required_argument, 0, 'C'},
+    {"fill", required_argument, 0, 'F'},
+    {"geometry", required_argument, 0, 'G'},
+    {"geometry-file", required_argument, 0, 'g'},
+    {"prefetch", required_argument, 0, 'P'},
+    {"prefetch-threads", required_argument, 0, 'T'},
     {"help", no_argument, 0, 'h'},
     {0, 0, 0, 0}
   };
   int c;
   int option_index = 0;
 
+  InitMapOpt(&opt);
+
   /* Parse input file */
   while (1) {
     c = getopt_long (argc, argv, "h", long_options, &option_index);
@@ -69,6 +124,95 @@ int main(int argc, char *argv[])
     switch (c) {
       case 0: /* If this option set a flag, do nothing else now. */
           break;
+      case 'p':
+        if (strcmp(optarg, "mmap") == 0) {
+          opt.readtext = MmapGraphFile;
+        }
+        else if (strcmp(optarg, "legacy") == 0) {
+          opt.readtext = ReadGraphFile;
+        }
+        else {
+          errexit("Unknown parser \"%s\". Use mmap or legacy.\n", optarg);
+        }
+        break;
+      case 'e':
+        if (strcmp(optarg, "text") == 0) {
+          opt.emit = EMIT_TEXT;
+        }
+        else if (strcmp(optarg, "binary") == 0) {
+          opt.emit = EMIT_BINARY;
+        }
+        else if (strcmp(optarg, "both") == 0) {
+          opt.emit = EMIT_TEXT | EMIT_BINARY;
+        }
+        else {
+          errexit("Unknown output format \"%s\". Use text, binary or both.\n", optarg);
+        }
+        break;
+      case 'E':
+        opt.emitthreads = atoi(optarg);
+        if (opt.emitthreads < 1) {
+          errexit("At least one emit thread is needed.\n");
+        }
+        break;
+      case 'M':
+        opt.partthreads = atoi(optarg);
+        if (opt.partthreads < 1) {
+          errexit("At least one partition thread is needed.\n");
+        }
+        break;
+      case 'A':
+        if (strcmp(optarg, "metis") == 0) {
+          opt.partitioner = PARTITIONER_METIS;
+        }
+        else if (strcmp(optarg, "native") == 0) {
+          opt.partitioner = PARTITIONER_NATIVE;
+        }
+        else {
+          errexit("Unknown partitioner \"%s\". Use native or metis.\n", optarg);
+        }
+        break;
+      case 'F':
+        if (strcmp(optarg, "ffd") == 0) {
+          opt.fill = FILL_FFD;
+        }
+        else if (strcmp(optarg, "best") == 0) {
+          opt.fill = FILL_BEST;
+        }
+        else {
+          errexit("Unknown fill policy \"%s\". Use ffd or best.\n", optarg);
+        }
+        break;
+      case 's':
+        opt.seed = atoi(optarg);
+        break;
+      case 'S':
+        opt.nseed = atoi(optarg);
+        if (opt.nseed < 1) {
+          errexit("At least one seed is needed.\n");
+        }
+        break;
+      case 'C':
+        opt.cachedir = optarg;
+        break;
+      case 'G':
+        ParseGeometry(optarg, "--geometry");
+        break;
+      case 'g':
+        LoadGeometry(optarg);
+        break;
+      case 'P':
+        opt.pfdepth = atoi(optarg);
+        if (opt.pfdepth < 0) {
+          errexit("The prefetch depth cannot be negative.\n");
+        }
+        break;
+      case 'T':
+        opt.pfthreads = atoi(optarg);
+        if (opt.pfthreads < 1) {
+          errexit("At least one prefetch thread is needed.\n");
+        }
+        break;
       case 'h':
         PrintHelp(argv[0]);
         return 0;
@@ -107,119 +251,24 @@ int main(int argc, char *argv[])
   free(ats);
   free(ngs);
 
-  /* Sort the automata */
-  qsort(automata, ngraph, sizeof(automata_t), CompAutomata);
-  minauto = ngraph-1;
-  minautosize = automata[minauto].nstate;
-
-  maxedge = automata[0].nedge;
-  for (i=0; i<ngraph; i++) {
-    automata[i].mapped = 0;
-    maxedge = (automata[i].nedge>maxedge)? automata[i].nedge: maxedge;
-  }
-  graph = CreateGraph(automata[0].nstate, maxedge, 1);
-  ungraph = CreateGraph(automata[0].nstate, maxedge * 2, 0);
-
-  chip = (chip_t*)malloc(CHIP_NUM * sizeof(chip_t));
-  for (i=0; i<CHIP_NUM; i++) {
-    ChipInit(&chip[i], has_g4);
-  }
-
-  for (i=0; i<ngraph; i++) {
-    if (automata[i].mapped) {
-      continue;
-    }
-
-    /* Read graph */
-    ReadGraphFile(graph, automata[i].fname, automata[i].nstate, automata[i].nedge);
-
-    for (k=0; k<CHIP_NUM; k++) {
-      succeed = MapGraphToChip(&chip[k], graph, ungraph, no_opt);
-      if (succeed == 1) {
-        break;
-      }
-    }
-    if (succeed != 1) {
-      errexit("%s cannot be mapped!\n", automata[i].fname);
-    }
-
-    automata[i].mapped = 1;
-    if (i == minauto) {
-      break;
-    }
-	
-    /* Fill the remaining part of a tile with small graphs */
-    while (chip[k].remain >= minautosize) {
-      for (j=minauto; (automata[j].nstate<=chip[k].remain) && (j>0); j--) {
-        if (!automata[j].mapped) {
-          candidate = j;
-        }
-      }
-      ReadGraphFile(graph, automata[candidate].fname,
-                    automata[candidate].nstate, automata[candidate].nedge);
-      MapGraphToChip(&chip[k], graph, graph, no_opt);
-      automata[candidate].mapped = 1;
-      fflush(stdout);
-
-      /* Update minimum automata size */
-      if (candidate == minauto) {
-        for (j=minauto-1; j>0; j--) {
-          if (!automata[j].mapped) {
-            minauto = j;
-            minautosize = automata[j].nstate;
-            break;
-          }
-        }
-        if (minauto == candidate) { /* No small automata */
-          minautosize = TILE_SIZE;
-        }
-      }
-    }
-    if (chip[k].remain < THRESHOLD)
-    {
-      chip[k].curtile++;
-      chip[k].remain = TILE_SIZE;
-    }
-  }
-
-  /* Report chip utilization */
-  ntile = 0;
-  for (k=0; k<CHIP_NUM; k++) {
-    if (chip[k].remain == TILE_SIZE) {
-      ntile += chip[k].curtile;
-    }
-    else {
-      ntile += chip[k].curtile + 1 - (float)chip[k].remain / TILE_SIZE;
-    }
-  }
-  printf("%.1f tiles in total\n", ntile);
-  fflush(stdout);
-
-  /* Emit mapping result */
-  fmap = fopen("map_result", "w");
-  if (!fmap) {
-    errexit("Cannot open file map_result!\n");
-  }
-  for (i=0; i<CHIP_NUM; i++) {
-    if (chip[i].curtile>0 || chip[i].remain<TILE_SIZE) {
-      fprintf(fmap, "**************\n");
-      fprintf(fmap, "*** Chip %d ***\n", i);
-      fprintf(fmap, "**************\n");
-      EmitChip(&chip[i], fmap);
-    }
-  }
-  fclose(fmap);
+  opt.has_g4 = has_g4;
+  opt.no_opt = no_opt;
+  opt.no_names = no_names;
+  opt.compact = compact;
+  opt.split = split;
+  opt.dedup = dedup;
+  opt.refine = refine;
+  opt.exhaustive = exhaustive;
+  opt.portbal = portbal;
+  opt.fastpath = fastpath;
+  opt.ahead = ahead;
+  opt.parchips = parchips;
+  MapAutomata(automata, ngraph, &opt, "map_result");
 
   /* Release resources */
-  FreeGraph(&graph, automata[0].nstate);
-  FreeGraph(&ungraph, automata[0].nstate);
   for (i=0; i<ngraph; i++) {
     free(automata[i].fname);
   }
   free(automata);
-  for (i=0; i<CHIP_NUM; i++) {
-    FreeChip(&chip[i]);
-  }
-  free(chip);
   return 0;
 }
@@ -0,0 +1,80 @@
+/*
+* Copyright (c) 2019, Delft University of Technology
+*
+* arena.c
+*
+* Functions related to the string arena that stores STE names
+*/
+#include "apmapbin.h"
+
+/*
+* Create a string arena with an initial capacity of *size* bytes
+*/
+arena_t *CreateArena(unsigned size)
+{
+  arena_t *arena = (arena_t*)malloc(sizeof(arena_t));
+
+  arena->maxsize = size > 0? size: 1;
+  arena->buf = (char*)malloc(arena->maxsize);
+  arena->size = 0;
+  pthread_mutex_init(&arena->lock, NULL);
+  return arena;
+}
+
+/*
+* Append *len* bytes and a terminating NUL to the arena.
+* Return the offset of the copied bytes. Safe to call from several threads.
+*/
+unsigned ArenaAdd(arena_t *arena, const char *str, unsigned len)
+{
+  unsigned off;
+
+  pthread_mutex_lock(&arena->lock);
+  if ((unsigned long long)arena->size + len + 1 > 0xFFFFFFFFULL) {
+    errexit("The STE names exceed the 4 GB string arena.\n");
+  }
+  if (arena->size + len + 1 > arena->maxsize) {
+    while (arena->size + len + 1 > arena->maxsize) {
+      arena->maxsize = (arena->maxsize > 0x7FFFFFFF)? 0xFFFFFFFF: arena->maxsize * 2;
+    }
+    arena->buf = (char*)realloc(arena->buf, arena->maxsize);
+    if (!arena->buf) {
+      errexit("Cannot grow the string arena to %u bytes!\n", arena->maxsize);
+    }
+  }
+  off = arena->size;
+  memcpy(arena->buf + off, str, len);
+  arena->buf[off + len] = '\0';
+  arena->size += len + 1;
+  pthread_mutex_unlock(&arena->lock);
+  return off;
+}
+
+/*
+* Get the string at a given offset.
+* The pointer is only valid until the next string is added.
+*/
+const char *ArenaGet(arena_t *arena, unsigned off)
+{
+  return arena->buf + off;
+}
+
+/*
+* Drop all strings in the arena but keep its memory
+*/
+void ResetArena(arena_t *arena)
+{
+  arena->size = 0;
+}
+
+/*
+* Free the resources in an arena
+*/
+void FreeArena(arena_t *arena)
+{
+  if (arena) {
+    pthread_mutex_destroy(&arena->lock);
+    free(arena->buf);
+    free(arena);
+  }
+}
@@ -0,0 +1,90 @@
+/*
+* Copyright (c) 2019, Delft University of Technology
+*
+* bundle.c
+*
+* Functions related to the bundled workload archive (.apb)
+*/
+
+#include "apmapbin.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+* Read the index of a bundled archive that has been opened as *fpin*.
+* The archive is mapped into memory and every automaton points to its own
+* graph file inside the mapping, so no further file has to be opened.
+* The mapping is kept until the program exits.
+*/
+automata_t *ReadBundleIndex(FILE *fpin, int *ngraph)
+{
+  automata_t *automata;
+  apb_header_t *header;
+  apb_entry_t *entry;
+  const char *buf;
+  struct stat st;
+  size_t size;
+  int i;
+
+  if (fstat(fileno(fpin), &st) != 0) {
+    errexit("Cannot stat the bundled archive.\n");
+  }
+  size = st.st_size;
+  if (size < sizeof(apb_header_t)) {
+    errexit("Premature end of the bundled archive.\n");
+  }
+  buf = (const char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fpin), 0);
+  if (buf == MAP_FAILED) {
+    errexit("Cannot map the bundled archive.\n");
+  }
+
+  header = (apb_header_t*)buf;
+  if (header->version != APB_VERSION) {
+    errexit("The bundled archive has version %u, but only version %d is supported.\n",
+            header->version, APB_VERSION);
+  }
+  *ngraph = header->ngraph;
+  if (*ngraph <= 0 || (size - sizeof(apb_header_t)) / sizeof(apb_entry_t) < header->ngraph) {
+    errexit("Wrong bundled archive.\n");
+  }
+
+  entry = (apb_entry_t*)(buf + sizeof(apb_header_t));
+  automata = (automata_t*)malloc(*ngraph * sizeof(automata_t));
+  for (i=0; i<*ngraph; i++) {
+    if (entry[i].offset > size || entry[i].length > size - entry[i].offset) {
+      errexit("CC %d is out of the bundled archive.\n", i);
+    }
+    if (entry[i].nstate == 0) {
+      errexit("Wrong size while reading CC %d.\n", i);
+    }
+    automata[i].nstate = entry[i].nstate;
+    automata[i].nedge = entry[i].nedge;
+    automata[i].data = buf + entry[i].offset;
+    automata[i].length = entry[i].length;
+    automata[i].cc = NULL;
+    automata[i].firstid = 0;
+    automata[i].fname = (char*)malloc(16);
+    sprintf(automata[i].fname, "CC%d", i);
+  }
+
+  return automata;
+}
+
+/*
+* Write the header and the index of a bundled archive at the start of *fpout*.
+* Call it with zeroed entries first to reserve the space, then again once the
+* offsets of all graph files are known.
+*/
+void WriteBundleIndex(FILE *fpout, apb_entry_t *entry, int ngraph)
+{
+  apb_header_t header;
+
+  memset(&header, 0, sizeof(apb_header_t));
+  memcpy(header.magic, APB_MAGIC, 4);
+  header.version = APB_VERSION;
+  header.ngraph = ngraph;
+
+  fseek(fpout, 0, SEEK_SET);
+  fwrite(&header, sizeof(apb_header_t), 1, fpout);
+  fwrite(entry, sizeof(apb_entry_t), ngraph, fpout);
+}
@@ -0,0 +1,369 @@
+/*
+* Copyright (c) 2019, Delft University of Technology
+*
+* cache.c
+*
+* Functions related to reusing graph partitions, both across runs through
+* an on-disk cache and within a run for structurally identical graphs
+*/
+#include "apmapbin.h"
+#include <unistd.h>
+
+/*
+* Mix one value into a 64-bit hash
+*/
+static unsigned long long HashMix(unsigned long long h, unsigned long long v)
+{
+  h ^= v + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+  h *= 0xFF51AFD7ED558CCDULL;
+  return h ^ (h >> 33);
+}
+
+/*
+* Hash an int array, starting from *h*
+*/
+static unsigned long long HashInts(unsigned long long h, const int *v, int n)
+{
+  int i;
+
+  for (i=0; i<n; i++) {
+    h = HashMix(h, (unsigned)v[i]);
+  }
+  return h;
+}
+
+/*
+* Hash the structure of a graph, i.e. its states and transitions but not
+* the STE masks, start and report flags or names
+*/
+unsigned long long StructHash(graph_t *graph)
+{
+  int nvtxs = graph->nvtxs;
+  unsigned long long h = HashMix(0x6A09E667F3BCC909ULL, nvtxs);
+
+  h = HashInts(h, graph->xadj, nvtxs + 1);
+  return HashInts(h, graph->adjncy, graph->xadj[nvtxs]);
+}
+
+/*
+* Restore a partition into the graph and rebuild the external parts of every state
+*/
+static void RestorePartition(graph_t *graph, graph_t *ungraph, list_t *choice,
+                             const int *where, int npart, int upart, int cost,
+                             const int *choicev, int nchoice)
+{
+  int *nin = (int*)malloc(TILE_NUM * sizeof(int));
+  int *nout = (int*)malloc(TILE_NUM * sizeof(int));
+  int i;
+
+  memcpy(graph->where, where, graph->nvtxs * sizeof(int));
+  graph->npart = npart;
+  graph->cost = cost;
+  ungraph->npart = upart;
+  EmptyList(choice);
+  for (i=0; i<nchoice; i++) {
+    ListAdd(choice, choicev[i]);
+  }
+  CountBoundaryNodes(graph, nin, nout);
+  free(nin);
+  free(nout);
+}
+
+/*
+* Compute the two halves of the cache key of a partitioning problem:
+* the directed graph, the head size, the mapping options that affect
+* partitioning and the chip geometry. key[0] names the cache file and
+* key[1] is stored inside it to tell colliding entries apart.
+*/
+void PartitionKey(graph_t *graph, int headsize, int has_g4, mapopt_t *opt,
+                  unsigned long long key[2])
+{
+  int nvtxs = graph->nvtxs;
+  int param[] = {PCACHE_VERSION, TILE_SIZE, TILE_NUM, GLOBAL_NUM, MAX_IN, THRESHOLD,
+#ifdef METIS_VER_MAJOR
+                 METIS_VER_MAJOR, METIS_VER_MINOR, METIS_VER_SUBMINOR,
+#endif
+                 nvtxs, graph->xadj[nvtxs], headsize, has_g4, opt->no_opt, opt->seed,
+                 opt->partitioner, opt->refine, opt->exhaustive,
+                 opt->portbal, opt->nseed};
+  int k;
+
+  for (k=0; k<2; k++) {
+    key[k] = (k == 0)? 0xCBF29CE484222325ULL: 0x84222325CBF29CE4ULL;
+    key[k] = HashInts(key[k], param, sizeof(param) / sizeof(int));
+    key[k] = HashInts(key[k], graph->xadj, nvtxs + 1);
+    key[k] = HashInts(key[k], graph->adjncy, graph->xadj[nvtxs]);
+  }
+}
+
+/*
+* Get the name of the cache file of a key
+*/
+static char *CacheFileName(const char *dir, unsigned long long key[2])
+{
+  char *fname = (char*)malloc(strlen(dir) + 32);
+
+  sprintf(fname, "%s/%016llx.part", dir, key[0]);
+  return fname;
+}
+
+/*
+* Look up a partition in the cache. On a hit the partition, its # of parts
+* and cost, and the fallback choices are restored, and 1 is returned.
+* A missing, stale or damaged entry is a miss.
+*/
+char LoadPartition(const char *dir, unsigned long long key[2], graph_t *graph,
+                   graph_t *ungraph, list_t *choice)
+{
+  char *fname = CacheFileName(dir, key);
+  FILE *fp = fopen(fname, "rb");
+  pcache_header_t header;
+  int *value;
+  char hit = 0;
+  int i;
+
+  free(fname);
+  if (!fp) {
+    return 0;
+  }
+  if (fread(&header, sizeof(pcache_header_t), 1, fp) != 1 ||
+      memcmp(header.magic, PCACHE_MAGIC, 4) != 0 || header.version != PCACHE_VERSION ||
+      header.key != key[1] || header.nvtxs != graph->nvtxs ||
+      header.npart < 1 || header.npart > TILE_NUM ||
+      header.upart < 1 || header.upart > TILE_NUM || header.cost < header.npart ||
+      header.nchoice < 0 || header.nchoice % 3 != 0) {
+    fclose(fp);
+    return 0;
+  }
+
+  value = (int*)malloc((header.nvtxs + header.nchoice + 1) * sizeof(int));
+  if (fread(value, sizeof(int), header.nvtxs + header.nchoice, fp)
+      == (size_t)(header.nvtxs + header.nchoice)) {
+    hit = 1;
+    for (i=0; i<header.nvtxs; i++) {
+      if (value[i] < 0 || value[i] >= header.upart) {
+        hit = 0;
+        break;
+      }
+    }
+    /* RePartitionGraph takes the choices as they are */
+    for (i=header.nvtxs; i<header.nvtxs+header.nchoice; i+=3) {
+      if (value[i] < 2 || value[i] > TILE_NUM || value[i+1] < 1 || value[i+1] > TILE_SIZE) {
+        hit = 0;
+        break;
+      }
+    }
+  }
+  fclose(fp);
+
+  if (hit) {
+    RestorePartition(graph, ungraph, choice, value, header.npart, header.upart, header.cost,
+                     value + header.nvtxs, header.nchoice);
+  }
+  free(value);
+  return hit;
+}
+
+/*
+* Store the partition of a graph in the cache.
+* The entry is written to a temporary file and renamed, so concurrent runs
+* and threads sharing the directory never see a partial entry. Failures only print a warning.
+*/
+void StorePartition(const char *dir, unsigned long long key[2], graph_t *graph,
+                    graph_t *ungraph, list_t *choice)
+{
+  char *fname = CacheFileName(dir, key);
+  char *tmpname = (char*)malloc(strlen(fname) + 32);
+  pcache_header_t header;
+  FILE *fp;
+  char ok;
+
+  sprintf(tmpname, "%s.%ld.%lx.tmp", fname, (long)getpid(), (unsigned long)pthread_self());
+  fp = fopen(tmpname, "wb");
+  if (!fp) {
+    fprintf(stderr, "Cannot write the partition cache in %s\n", dir);
+    free(tmpname);
+    free(fname);
+    return;
+  }
+
+  memset(&header, 0, sizeof(pcache_header_t));
+  memcpy(header.magic, PCACHE_MAGIC, 4);
+  header.version = PCACHE_VERSION;
+  header.key = key[1];
+  header.nvtxs = graph->nvtxs;
+  header.npart = graph->npart;
+  header.upart = ungraph->npart;
+  header.cost = graph->cost;
+  header.nchoice = choice->size;
+  ok = fwrite(&header, sizeof(pcache_header_t), 1, fp) == 1;
+  ok = ok && fwrite(graph->where, sizeof(int), graph->nvtxs, fp) == (size_t)graph->nvtxs;
+  ok = ok && fwrite(choice->value, sizeof(int), choice->size, fp) == (size_t)choice->size;
+  ok = (fclose(fp) == 0) && ok;
+  if (!ok || rename(tmpname, fname) != 0) {
+    fprintf(stderr, "Cannot write the partition cache in %s\n", dir);
+    remove(tmpname);
+  }
+  free(tmpname);
+  free(fname);
+}
+
+/*
+* Create an empty table of graph classes
+*/
+classtab_t *CreateClassTable(void)
+{
+  classtab_t *tab = (classtab_t*)malloc(sizeof(classtab_t));
+
+  tab->nslot = 64;
+  tab->slot = (ccclass_t**)calloc(tab->nslot, sizeof(ccclass_t*));
+  tab->ncls = 0;
+  tab->nreuse = 0;
+  pthread_mutex_init(&tab->lock, NULL);
+  return tab;
+}
+
+/*
+* Find the slot of a graph class, or the empty slot where it belongs
+*/
+static int FindClassSlot(classtab_t *tab, graph_t *graph, int headsize)
+{
+  int nvtxs = graph->nvtxs;
+  int mask = tab->nslot - 1;
+  int i = (int)(HashMix(graph->shash, headsize) & mask);
+  ccclass_t *cls;
+
+  while ((cls = tab->slot[i]) != NULL) {
+    if (cls->shash == graph->shash && cls->headsize == headsize && cls->nvtxs == nvtxs &&
+        memcmp(cls->xadj, graph->xadj, (nvtxs + 1) * sizeof(int)) == 0 &&
+        memcmp(cls->adjncy, graph->adjncy, graph->xadj[nvtxs] * sizeof(int)) == 0) {
+      break;
+    }
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+/*
+* Reuse the partition of a structurally identical graph that was partitioned
+* with the same head size in this run. Returns 1 if there is one.
+*/
+char LookupClass(classtab_t *tab, graph_t *graph, graph_t *ungraph, int headsize,
+                 list_t *choice)
+{
+  ccclass_t *cls;
+
+  pthread_mutex_lock(&tab->lock);
+  cls = tab->slot[FindClassSlot(tab, graph, headsize)];
+  if (cls) {
+    tab->nreuse++;
+  }
+  pthread_mutex_unlock(&tab->lock);
+
+  /* A class is never changed or freed before the table, so no lock is needed */
+  if (!cls) {
+    return 0;
+  }
+  RestorePartition(graph, ungraph, choice, cls->where, cls->npart, cls->upart, cls->cost,
+                   cls->choice.value, cls->choice.size);
+  graph->shaped = cls->shaped;
+  return 1;
+}
+
+/*
+* Whether the partition of a graph with this structure and head size is known
+*/
+char HasClass(classtab_t *tab, graph_t *graph, int headsize)
+{
+  char known;
+
+  pthread_mutex_lock(&tab->lock);
+  known = tab->slot[FindClassSlot(tab, graph, headsize)] != NULL;
+  pthread_mutex_unlock(&tab->lock);
+  return known;
+}
+
+/*
+* Remember the partition of a graph for the rest of the run
+*/
+void AddClass(classtab_t *tab, graph_t *graph, graph_t *ungraph, int headsize,
+              list_t *choice)
+{
+  int nvtxs = graph->nvtxs;
+  int nedges = graph->xadj[nvtxs];
+  ccclass_t **old;
+  ccclass_t *cls;
+  int nold;
+  int i, j;
+
+  pthread_mutex_lock(&tab->lock);
+
+  /* Keep the load factor below one half */
+  if (2 * (tab->ncls + 1) > tab->nslot) {
+    old = tab->slot;
+    nold = tab->nslot;
+    tab->nslot *= 2;
+    tab->slot = (ccclass_t**)calloc(tab->nslot, sizeof(ccclass_t*));
+    for (i=0; i<nold; i++) {
+      if (old[i]) {
+        j = (int)(HashMix(old[i]->shash, old[i]->headsize) & (tab->nslot - 1));
+        while (tab->slot[j]) {
+          j = (j + 1) & (tab->nslot - 1);
+        }
+        tab->slot[j] = old[i];
+      }
+    }
+    free(old);
+  }
+
+  i = FindClassSlot(tab, graph, headsize);
+  if (tab->slot[i]) {
+    pthread_mutex_unlock(&tab->lock);
+    return;
+  }
+  cls = (ccclass_t*)malloc(sizeof(ccclass_t));
+  cls->shash = graph->shash;
+  cls->headsize = headsize;
+  cls->nvtxs = nvtxs;
+  cls->xadj = (int*)malloc((nvtxs + 1) * sizeof(int));
+  memcpy(cls->xadj, graph->xadj, (nvtxs + 1) * sizeof(int));
+  cls->adjncy = (int*)malloc((nedges + 1) * sizeof(int));
+  memcpy(cls->adjncy, graph->adjncy, nedges * sizeof(int));
+  cls->where = (int*)malloc(nvtxs * sizeof(int));
+  memcpy(cls->where, graph->where, nvtxs * sizeof(int));
+  cls->npart = graph->npart;
+  cls->upart = ungraph->npart;
+  cls->cost = graph->cost;
+  cls->shaped = graph->shaped;
+  InitList(&cls->choice, choice->size + 1);
+  for (j=0; j<choice->size; j++) {
+    ListAdd(&cls->choice, choice->value[j]);
+  }
+  tab->slot[i] = cls;
+  tab->ncls++;
+  pthread_mutex_unlock(&tab->lock);
+}
+
+/*
+* Free a table of graph classes
+*/
+void FreeClassTable(classtab_t *tab)
+{
+  int i;
+
+  if (!tab) {
+    return;
+  }
+  for (i=0; i<tab->nslot; i++) {
+    if (tab->slot[i]) {
+      free(tab->slot[i]->xadj);
+      free(tab->slot[i]->adjncy);
+      free(tab->slot[i]->where);
+      free(tab->slot[i]->choice.value);
+      free(tab->slot[i]);
+    }
+  }
+  pthread_mutex_destroy(&tab->lock);
+  free(tab->slot);
+  free(tab);
+}
@@ -15,19 +15,21 @@ void ChipInit(chip_t *chip, char has_g4)
 {
   int i, j;
 
+  chip->names = NULL;
   chip->curtile = 0;
   chip->remain = TILE_SIZE;
+  InitJournal(&chip->journal);
 
   // Init global switches
+  chip->global = (global_t*)malloc(GLOBAL_NUM * sizeof(global_t));
   for (i=0; i<GLOBAL_NUM; i++) {
     InitGlobal(&chip->global[i]);
   }
   if (has_g4) {
     chip->g4 = (g4_t*)malloc(sizeof(g4_t));
-    for (j=0; j<TILE_NUM; j++) {
-      for (i=0; i<8; i++) {
-        chip->g4->src[j][i] = -1;
-      }
+    chip->g4->src = (int*)malloc(TILE_NUM * G4_WIDTH * sizeof(int));
+    for (j=0; j<TILE_NUM * G4_WIDTH; j++) {
+      chip->g4->src[j] = -1;
     }
   }
   else {
@@ -35,6 +37,7 @@ void ChipInit(chip_t *chip, char has_g4)
   }
 
   // Init tiles
+  chip->tile = (tile_t*)malloc(TILE_NUM * sizeof(tile_t));
   for (i=0; i<TILE_NUM; i++) {
     InitTile(&chip->tile[i], has_g4);
   }
@@ -50,9 +53,6 @@ char MapLargeGraph(chip_t *chip, graph_t *graph, char use)
 {
   int curtile = chip->curtile;
   int npart = graph->npart;
-  global_t gback[GLOBAL_NUM];
-  g4_t g4back;
-  tile_t tback;
   int remain = chip->remain;
   int oldnpart, oldtile;
   int i, j;
@@ -66,24 +66,18 @@ char MapLargeGraph(chip_t *chip, graph_t *graph, char use)
     return 0;
   }
 
-  /* Backup in case of mapping failure */
+  /* The switch entries that change are journaled in case of mapping failure */
   oldnpart = graph->npart;
   oldtile = curtile;
-  CopyGlobal(gback, chip->global);
-  if (chip->g4 != NULL) {
-    CopyG4(&g4back, chip->g4);
-  }
 
-  ResolveConstraint(&chip->tile[curtile], graph, chip->g4 != NULL);
+  ResolveConstraint(&chip->tile[curtile], graph, chip->g4 != NULL, &chip->journal);
   if (MapGlobal(chip, graph, &curtile) == 1) {
+    CommitJournal(&chip->journal);
     CopyGraphToTile(chip, graph, oldtile);
   }
   else { /* Roll back */
     graph->npart = oldnpart;
-    CopyGlobal(chip->global, gback);
-    if (chip->g4 != NULL) {
-      CopyG4(chip->g4, &g4back);
-    }
+    RollbackJournal(&chip->journal);
     if (remain == TILE_SIZE) {
       ResetTile(&chip->tile[curtile]);
     }
@@ -95,7 +89,41 @@ char MapLargeGraph(chip_t *chip, graph_t *graph, char use)
   return 1;
 }
 
-char MapGraphToChip(chip_t *chip, graph_t *graph, graph_t *ungraph, int no_opt)
+/*
+* Map a graph again with the partitions of a normal sweep. A partition
+* cut in topological order (graph->shaped) has no fallback choices, so
+* this is the only other option when the switches run out.
+*/
+static char MapWithSweep(chip_t *chip, graph_t *graph, graph_t *ungraph, list_t *choice,
+                         mapopt_t *opt)
+{
+  mapopt_t sweep = *opt;
+  char succeed;
+  char use;
+
+  /* The partitions of this run may be the ones of the fast path */
+  sweep.fastpath = 0;
+  sweep.classes = NULL;
+  sweep.aheadtab = NULL;
+  sweep.ncall = sweep.nsaved = sweep.nwin = 0;
+  sweep.cachehit = sweep.cachemiss = 0;
+
+  use = PartitionGraph(ungraph, graph, chip->remain, choice, chip->g4 != NULL, &sweep);
+  succeed = MapLargeGraph(chip, graph, use);
+  while (choice->size > 0 && succeed != 1) {
+    RePartitionGraph(ungraph, graph, choice, chip->g4 != NULL, &sweep);
+    succeed = MapLargeGraph(chip, graph, 0);
+  }
+
+  opt->ncall += sweep.ncall;
+  opt->nsaved += sweep.nsaved;
+  opt->nwin += sweep.nwin;
+  opt->cachehit += sweep.cachehit;
+  opt->cachemiss += sweep.cachemiss;
+  return succeed;
+}
+
+char MapGraphToChip(chip_t *chip, graph_t *graph, graph_t *ungraph, mapopt_t *opt)
 {
   list_t parchoice;
   char succeed;
@@ -130,53 +158,195 @@ char MapGraphToChip(chip_t *chip, graph_t *graph, graph_t *ungraph, int no_opt)
   GetUndiGraph(graph, ungraph);
 
   /* Partition the graph */
-  use = PartitionGraph(ungraph, graph, chip->remain, &parchoice, chip->g4 != NULL, no_opt);
+  use = PartitionGraph(ungraph, graph, chip->remain, &parchoice, chip->g4 != NULL, opt);
 
   succeed = MapLargeGraph(chip, graph, use);
   /* If failed, give up the remaining part on the current tile and start with a fresh tile. */
   if (succeed!=1 && chip->remain!=TILE_SIZE) {
     chip->curtile++;
     chip->remain = TILE_SIZE;
-    use = PartitionGraph(ungraph, graph, chip->remain, &parchoice, chip->g4 != NULL, no_opt);
+    use = PartitionGraph(ungraph, graph, chip->remain, &parchoice, chip->g4 != NULL, opt);
     succeed = MapLargeGraph(chip, graph, use);
   }
   while (parchoice.size>0 && succeed!=1) {
-    RePartitionGraph(ungraph, graph, &parchoice, chip->g4 != NULL);
+    RePartitionGraph(ungraph, graph, &parchoice, chip->g4 != NULL, opt);
     succeed = MapLargeGraph(chip, graph, 0);
     if (succeed == 1) {
       break;
     }
   }
 
+  /* The fast path gives the fewest tiles, so only a lack of switches is worth a sweep */
+  if (succeed == -1 && graph->shaped) {
+    succeed = MapWithSweep(chip, graph, ungraph, &parchoice, opt);
+  }
+
   free(parchoice.value);
   return succeed;
 }
 
 /*
-* Emit the mapping result to files
+* Render one piece of the mapping result into the buffer of the job
 */
-void EmitChip(chip_t *chip, FILE* fp)
+static void RenderJob(emitjob_t *job, char compact)
 {
-  int curtile = chip->curtile;
-  int remain = chip->remain;
+  chip_t *chip = job->chip;
+
+  InitOutBuf(&job->out, NULL, 1 << 16);
+  if (job->sw == GLOBAL_NUM) {
+    EmitG4(chip->g4, chip->tile, compact, &job->out);
+  }
+  else if (job->sw >= 0) {
+    EmitGlobal(&chip->global[job->sw], job->sw, chip->tile, compact, &job->out);
+  }
+  else {
+    BufPutStr(&job->out, "\n--- Tile ");
+    BufPutInt(&job->out, job->tile);
+    BufPutStr(&job->out, " ---\n");
+    EmitTile(&chip->tile[job->tile], chip->names, compact, &job->out);
+  }
+}
+
+/*
+* Rendering thread. Take jobs in order until none is left.
+*/
+static void *EmitWorker(void *arg)
+{
+  emitpool_t *pool = (emitpool_t*)arg;
+  int index;
+
+  while (1) {
+    pthread_mutex_lock(&pool->lock);
+    index = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+    if (index >= pool->njob) {
+      break;
+    }
+    RenderJob(&pool->job[index], pool->compact);
+  }
+  return NULL;
+}
+
+/*
+* Split the text of a chip into jobs. Returns the # of jobs added to *job*.
+*/
+static int AddChipJobs(chip_t *chip, emitjob_t *job)
+{
+  int njob = 0;
   int i;
 
-  if (curtile > 0) {
-    EmitGlobal(chip->global, chip->tile, fp);
+  if (chip->curtile > 0) {
+    for (i=0; i<GLOBAL_NUM; i++) {
+      job[njob].chip = chip;
+      job[njob].sw = i;
+      njob++;
+    }
     if (chip->g4 != NULL) {
-      EmitG4(chip->g4, chip->tile, fp);
+      job[njob].chip = chip;
+      job[njob].sw = GLOBAL_NUM;
+      njob++;
+    }
+  }
+  for (i=0; i<chip->curtile + (chip->remain < TILE_SIZE); i++) {
+    job[njob].chip = chip;
+    job[njob].sw = -1;
+    job[njob].tile = i;
+    njob++;
+  }
+  return njob;
+}
+
+/*
+* Emit the text mapping result of all used chips to *outfile*, or to one
+* file per chip (*outfile*.chipN) if opt->split is set.
+* Switches and tiles are rendered into their own buffers by opt->emitthreads
+* threads and then written in order, so the text does not depend on the
+* # of threads.
+*/
+void EmitChips(chip_t *chip, int nchip, mapopt_t *opt, const char *outfile)
+{
+  emitpool_t pool;
+  pthread_t *thread;
+  int nthreads = (opt->emitthreads > 0)? opt->emitthreads: 1;
+  int *first;
+  char *fname;
+  FILE *fp = NULL;
+  int i, j;
+
+  pool.job = (emitjob_t*)malloc(nchip * (GLOBAL_NUM + 1 + TILE_NUM) * sizeof(emitjob_t));
+  pool.njob = 0;
+  pool.next = 0;
+  pool.compact = opt->compact;
+  first = (int*)malloc((nchip + 1) * sizeof(int));
+  for (i=0; i<nchip; i++) {
+    first[i] = pool.njob;
+    if (chip[i].curtile>0 || chip[i].remain<TILE_SIZE) {
+      pool.njob += AddChipJobs(&chip[i], pool.job + pool.njob);
+    }
+  }
+  first[nchip] = pool.njob;
+
+  /* Render all pieces; the calling thread is one of the renderers */
+  pthread_mutex_init(&pool.lock, NULL);
+  thread = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+  for (i=1; i<nthreads; i++) {
+    if (pthread_create(&thread[i], NULL, EmitWorker, &pool) != 0) {
+      errexit("Cannot create emit thread %d!\n", i);
     }
   }
+  EmitWorker(&pool);
+  for (i=1; i<nthreads; i++) {
+    pthread_join(thread[i], NULL);
+  }
+  pthread_mutex_destroy(&pool.lock);
+  free(thread);
 
-  for (i=0; i<curtile; i++) {
-    fprintf(fp, "\n--- Tile %d ---\n", i);
-    EmitTile(&chip->tile[i], fp);
+  /* Write the pieces in order */
+  fname = (char*)malloc(strlen(outfile) + 32);
+  for (i=0; i<nchip; i++) {
+    if (chip[i].curtile==0 && chip[i].remain==TILE_SIZE) {
+      continue;
+    }
+    if (!fp) {
+      if (opt->split) {
+        sprintf(fname, "%s.chip%d", outfile, i);
+      }
+      else {
+        strcpy(fname, outfile);
+      }
+      fp = fopen(fname, "w");
+      if (!fp) {
+        errexit("Cannot open file %s!\n", fname);
+      }
+    }
+    fprintf(fp, "**************\n");
+    fprintf(fp, "*** Chip %d ***\n", i);
+    fprintf(fp, "**************\n");
+    for (j=first[i]; j<first[i+1]; j++) {
+      pool.job[j].out.fp = fp;
+      FreeOutBuf(&pool.job[j].out);
+    }
+    fprintf(fp, "\n");
+    if (opt->split) {
+      fclose(fp);
+      fp = NULL;
+    }
   }
-  if (chip->remain < TILE_SIZE) {
-    fprintf(fp, "\n--- Tile %d ---\n", curtile);
-    EmitTile(&chip->tile[curtile], fp);
+  if (fp) {
+    fclose(fp);
   }
-  fprintf(fp, "\n");
+  else if (!opt->split) {
+    /* Nothing is mapped, but the result file is still expected */
+    fp = fopen(outfile, "w");
+    if (!fp) {
+      errexit("Cannot open file %s!\n", outfile);
+    }
+    fclose(fp);
+  }
+
+  free(fname);
+  free(first);
+  free(pool.job);
 }
 
 /*
@@ -189,5 +359,14 @@ void FreeChip(chip_t *chip)
   for (i=0; i<TILE_NUM; i++) {
     FreeTile(&chip->tile[i]);
   }
+  free(chip->tile);
+  for (i=0; i<GLOBAL_NUM; i++) {
+    FreeGlobal(&chip->global[i]);
+  }
+  free(chip->global);
+  if (chip->g4 != NULL) {
+    free(chip->g4->src);
+  }
   free(chip->g4);
+  FreeJournal(&chip->journal);
 }
@@ -0,0 +1,222 @@
+/*
+* Copyright (c) 2019, Delft University of Technology
+*
+* fill.c
+*
+* Index of the automata that are not mapped yet, used for filling the
+* rest of a tile with small graphs. The automata are sorted by size, so
+* the ones of a given size are a contiguous range; a Fenwick tree over the
+* positions finds the first unmapped one in a range in O(log n).
+* For best-fit, a second Fenwick tree over the # of free states finds the
+* open tile with the fewest free states that a graph fits in.
+*/
+#include "apmapbin.h"
+
+/*
+* Create the index of the automata idx[0..n-1], which are sorted by size
+* and all unmapped
+*/
+fillidx_t *CreateFillIndex(automata_t *automata, const int *idx, int n)
+{
+  fillidx_t *fi = (fillidx_t*)malloc(sizeof(fillidx_t));
+  int i, j, s;
+
+  fi->n = n;
+  fi->nleft = n;
+  fi->tree = (int*)malloc((n + 1) * sizeof(int));
+  fi->first = (int*)malloc((TILE_SIZE + 1) * sizeof(int));
+
+  /* Every position holds 1; tree[i] sums the positions (i - lowbit(i), i] */
+  for (i=1; i<=n; i++) {
+    fi->tree[i] = i & (-i);
+  }
+
+  /* first[s] is the first position with at most s states */
+  j = n;
+  for (s=0; s<=TILE_SIZE; s++) {
+    while (j > 0 && automata[idx[j-1]].nstate <= s) {
+      j--;
+    }
+    fi->first[s] = j;
+  }
+
+  for (fi->logn=1; (1 << fi->logn) <= n; fi->logn++);
+  return fi;
+}
+
+/*
+* Add *delta* to position *pos* of a Fenwick tree over *n* positions
+*/
+static void TreeAdd(int *tree, int n, int pos, int delta)
+{
+  int i;
+
+  for (i=pos+1; i<=n; i+=i&(-i)) {
+    tree[i] += delta;
+  }
+}
+
+/*
+* The sum of the positions before *pos* of a Fenwick tree
+*/
+static int TreeSum(const int *tree, int pos)
+{
+  int sum = 0;
+  int i;
+
+  for (i=pos; i>0; i-=i&(-i)) {
+    sum += tree[i];
+  }
+  return sum;
+}
+
+/*
+* The position at which the sum of a Fenwick tree over *n* positions
+* reaches *rank*, which must not exceed the total
+*/
+static int TreeFind(const int *tree, int n, int logn, int rank)
+{
+  int cur = 0;
+  int step;
+
+  for (step=1<<logn; step>0; step>>=1) {
+    if (cur + step <= n && tree[cur+step] < rank) {
+      cur += step;
+      rank -= tree[cur];
+    }
+  }
+  return cur;
+}
+
+/*
+* Mark position *pos* as mapped
+*/
+void RemoveFillIndex(fillidx_t *fi, int pos)
+{
+  TreeAdd(fi->tree, fi->n, pos, -1);
+  fi->nleft--;
+}
+
+/*
+* The first unmapped position at or after *pos*, or -1 if there is none
+*/
+int NextUnmapped(fillidx_t *fi, int pos)
+{
+  int rank;
+
+  if (pos >= fi->n) {
+    return -1;
+  }
+  rank = TreeSum(fi->tree, pos) + 1;
+  if (rank > fi->nleft) {
+    return -1;
+  }
+  return TreeFind(fi->tree, fi->n, fi->logn, rank);
+}
+
+/*
+* The largest unmapped automaton with at most *room* states, i.e. the first
+* one in the sorted order, or -1 if none fits
+*/
+int LargestFit(fillidx_t *fi, int room)
+{
+  if (room < 1) {
+    return -1;
+  }
+  return NextUnmapped(fi, fi->first[(room < TILE_SIZE)? room: TILE_SIZE]);
+}
+
+/*
+* Create the index of the open tiles of *nchip* chips: every tile up to
+* the current one of a chip that still has free states
+*/
+roomidx_t *CreateRoomIndex(chip_t *chip, int nchip)
+{
+  roomidx_t *ri = (roomidx_t*)malloc(sizeof(roomidx_t));
+  int room;
+  int i, j, k;
+
+  ri->n = TILE_SIZE;
+  ri->nopen = 0;
+  ri->tree = (int*)calloc(ri->n + 1, sizeof(int));
+  ri->open = (list_t*)malloc(ri->n * sizeof(list_t));
+  for (i=0; i<ri->n; i++) {
+    InitList(&ri->open[i], 4);
+  }
+  for (ri->logn=1; (1 << ri->logn) <= ri->n; ri->logn++);
+
+  for (k=0; k<nchip; k++) {
+    for (i=0; i<=chip[k].curtile && i<TILE_NUM; i++) {
+      room = 0;
+      for (j=0; j<TILE_SIZE; j++) {
+        room += (chip[k].tile[i].state[j] == -1);
+      }
+      AddRoom(ri, k, i, room);
+    }
+  }
+  return ri;
+}
+
+/*
+* Add tile *tile* of chip *k*, which has *room* free states, to the open
+* tiles. A full tile is left out.
+*/
+void AddRoom(roomidx_t *ri, int k, int tile, int room)
+{
+  if (room < 1) {
+    return;
+  }
+  ListAdd(&ri->open[room-1], k * TILE_NUM + tile);
+  TreeAdd(ri->tree, ri->n, room - 1, 1);
+  ri->nopen++;
+}
+
+/*
+* Take the open tile with the fewest free states, at least *size*, out of
+* the index. Its chip and tile are stored in *k* and *tile*.
+* Returns its # of free states, or -1 if no open tile has enough.
+*/
+int TightestRoom(roomidx_t *ri, int size, int *k, int *tile)
+{
+  int rank, room, id;
+
+  if (size > ri->n) {
+    return -1;
+  }
+  rank = TreeSum(ri->tree, size - 1) + 1;
+  if (rank > ri->nopen) {
+    return -1;
+  }
+  room = TreeFind(ri->tree, ri->n, ri->logn, rank) + 1;
+  id = ListPop(&ri->open[room-1]);
+  TreeAdd(ri->tree, ri->n, room - 1, -1);
+  ri->nopen--;
+  *k = id / TILE_NUM;
+  *tile = id % TILE_NUM;
+  return room;
+}
+
+/*
+* Free a room index
+*/
+void FreeRoomIndex(roomidx_t *ri)
+{
+  int i;
+
+  for (i=0; i<ri->n; i++) {
+    free(ri->open[i].value);
+  }
+  free(ri->open);
+  free(ri->tree);
+  free(ri);
+}
+
+/*
+* Free an index
+*/
+void FreeFillIndex(fillidx_t *fi)
+{
+  free(fi->tree);
+  free(fi->first);
+  free(fi);
+}
@@ -0,0 +1,128 @@
+/*
+* Copyright (c) 2019, Delft University of Technology
+*
+* geometry.c
+*
+* The geometry of the chips, which is set at run time. A geometry is
+* written as key=value items, separated by commas, spaces or newlines;
+* a '#' starts a comment that runs to the end of the line. The keys are
+* tiles, tile-size, globals, chips, threshold and g4-width. Keys that are
+* left out keep their values.
+*/
+#include "apmapbin.h"
+
+geometry_t geom = {DEF_TILE_NUM, DEF_TILE_SIZE, DEF_GLOBAL_NUM, DEF_CHIP_NUM,
+                   DEF_THRESHOLD, DEF_G4_WIDTH};
+
+/*
+* Check that the chips can be built and written with the geometry
+*/
+static void CheckGeometry(const char *source)
+{
+  if (geom.tile_num < 1 || geom.global_num < 1 || geom.chip_num < 1 || geom.g4_width < 1) {
+    errexit("Geometry in %s: tiles, globals, chips and g4-width must be positive.\n", source);
+  }
+  if (geom.tile_size < 32 || geom.tile_size % 32 != 0) {
+    errexit("Geometry in %s: tile-size must be a positive multiple of 32.\n", source);
+  }
+  if (2 * geom.global_num + geom.g4_width > geom.tile_size) {
+    errexit("Geometry in %s: a tile has fewer STEs than global switch outputs.\n", source);
+  }
+  if (geom.threshold < 0 || geom.threshold > geom.tile_size) {
+    errexit("Geometry in %s: threshold must be between 0 and tile-size.\n", source);
+  }
+}
+
+/*
+* Set the geometry from the items in *text*. *source* names the text in
+* error messages.
+*/
+void ParseGeometry(const char *text, const char *source)
+{
+  const char *p = text;
+  char key[32];
+  int *field = NULL;
+  int len, value;
+
+  while (*p != '\0') {
+    if (*p == '#') {
+      while (*p != '\0' && *p != '\n') {
+        p++;
+      }
+      continue;
+    }
+    if (*p == ',' || *p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+      p++;
+      continue;
+    }
+
+    for (len=0; p[len]!='\0' && p[len]!='='; len++);
+    if (p[len] != '=' || len >= (int)sizeof(key)) {
+      errexit("Geometry in %s: expected key=value at \"%.20s\".\n", source, p);
+    }
+    memcpy(key, p, len);
+    key[len] = '\0';
+    p += len + 1;
+
+    if (strcmp(key, "tiles") == 0) {
+      field = &geom.tile_num;
+    }
+    else if (strcmp(key, "tile-size") == 0) {
+      field = &geom.tile_size;
+    }
+    else if (strcmp(key, "globals") == 0) {
+      field = &geom.global_num;
+    }
+    else if (strcmp(key, "chips") == 0) {
+      field = &geom.chip_num;
+    }
+    else if (strcmp(key, "threshold") == 0) {
+      field = &geom.threshold;
+    }
+    else if (strcmp(key, "g4-width") == 0) {
+      field = &geom.g4_width;
+    }
+    else {
+      errexit("Geometry in %s: unknown key \"%s\".\n", source, key);
+    }
+
+    if (sscanf(p, "%d%n", &value, &len) != 1) {
+      errexit("Geometry in %s: %s needs a number.\n", source, key);
+    }
+    *field = value;
+    p += len;
+  }
+  CheckGeometry(source);
+}
+
+/*
+* Library entry point of ParseGeometry
+*/
+void ApmapSetGeometry(const char *spec)
+{
+  ParseGeometry(spec, "ApmapSetGeometry");
+}
+
+/*
+* Set the geometry from a file
+*/
+void LoadGeometry(const char *file)
+{
+  FILE *fp = fopen(file, "r");
+  char *text;
+  long size;
+
+  if (!fp) {
+    errexit("Cannot open geometry file %s!\n", file);
+  }
+  fseek(fp, 0, SEEK_END);
+  size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  text = (char*)malloc(size + 1);
+  size = fread(text, 1, size, fp);
+  text[size] = '\0';
+  fclose(fp);
+
+  ParseGeometry(text, file);
+  free(text);
+}
@@ -13,6 +13,8 @@
 void InitGlobal(global_t *global)
 {
   int j;
+
+  global->src = (int(*)[2])malloc(TILE_NUM * sizeof(*global->src));
   for (j=0; j<TILE_NUM; j++) {
     global->src[j][0] = -1;
     global->src[j][1] = -1;
@@ -20,10 +22,20 @@ void InitGlobal(global_t *global)
 }
 
 /*
-* Map the output of a state to a 1-way global switch
+* Release a global switch
+*/
+void FreeGlobal(global_t *global)
+{
+  free(global->src);
+  global->src = NULL;
+}
+
+/*
+* Map the output of a state to a 1-way global switch, recording the
+* changes in *log*
 * return 0 if fail; return 1 if succeed.
 */
-char MapStateToGlobal(global_t *global, list_t *ext, int src, int curtile)
+char MapStateToGlobal(global_t *global, list_t *ext, int src, int curtile, journal_t *log)
 {
   int dest;
   int i;
@@ -41,20 +53,21 @@ char MapStateToGlobal(global_t *global, list_t *ext, int src, int curtile)
   for (i=0; i<ext->size; i++) {
     dest = ext->value[i] + curtile;
     if (global->src[dest][0] == -1) {
-      global->src[dest][0] = src;
+      JournalSet(log, &global->src[dest][0], src);
     }
     else {
-      global->src[dest][1] = src;
+      JournalSet(log, &global->src[dest][1], src);
     }
   }
   return 1;
 }
 
 /*
-* Map the output of a state to a 4-way global switch
+* Map the output of a state to a 4-way global switch, recording the
+* changes in *log*
 * return 0 if fail; return 1 if succeed.
 */
-char MapStateToG4(g4_t *g4, list_t *ext, int src, int curtile)
+char MapStateToG4(g4_t *g4, list_t *ext, int src, int curtile, journal_t *log)
 {
   int dest;
   int i, j;
@@ -62,7 +75,7 @@ char MapStateToG4(g4_t *g4, list_t *ext, int src, int curtile)
   /* detect */
   for (i=0; i<ext->size; i++) {
     dest = ext->value[i] + curtile;
-    if (g4->src[dest][7] != -1) {
+    if (g4->src[dest * G4_WIDTH + G4_WIDTH - 1] != -1) {
       return 0;
     }
   }
@@ -70,9 +83,9 @@ char MapStateToG4(g4_t *g4, list_t *ext, int src, int curtile)
   /* map */
   for (i=0; i<ext->size; i++) {
     dest = ext->value[i] + curtile;
-    for (j=0; j<8; j++) {
-      if (g4->src[dest][j] == -1) {
-        g4->src[dest][j] = src;
+    for (j=0; j<G4_WIDTH; j++) {
+      if (g4->src[dest * G4_WIDTH + j] == -1) {
+        JournalSet(log, &g4->src[dest * G4_WIDTH + j], src);
         break;
       }
     }
@@ -80,8 +93,9 @@ char MapStateToG4(g4_t *g4, list_t *ext, int src, int curtile)
   return 1;
 }
 
-/* 
-* Config global switches according to the tiles 
+/*
+* Config global switches according to the tiles. Every change goes through
+* chip->journal, so that the caller can roll it back.
 */
 char MapGlobal(chip_t *chip, graph_t *graph, int *curtile)
 {
@@ -89,6 +103,7 @@ char MapGlobal(chip_t *chip, graph_t *graph, int *curtile)
   global_t *global = chip->global;
   g4_t *g4 = chip->g4;
   tile_t *tile = chip->tile;
+  journal_t *log = &chip->journal;
   list_t *ext;
   int state;
   char mapped;
@@ -98,14 +113,14 @@ char MapGlobal(chip_t *chip, graph_t *graph, int *curtile)
     for (j=0; j<GLOBAL_NUM; j++) {
       for (k=0; k<2; k++) {
         if (global[j].src[*curtile][k] != -1) {
-          global[j].src[*curtile][k] = -2;
+          JournalSet(log, &global[j].src[*curtile][k], -2);
         }
       }
     }
     if (g4 != NULL) {
-      for (k=0; k<8; k++) {
-        if (g4->src[*curtile][k] != -1) {
-          g4->src[*curtile][k] = -2;
+      for (k=0; k<G4_WIDTH; k++) {
+        if (g4->src[*curtile * G4_WIDTH + k] != -1) {
+          JournalSet(log, &g4->src[*curtile * G4_WIDTH + k], -2);
         }
       }
     }
@@ -118,26 +133,26 @@ char MapGlobal(chip_t *chip, graph_t *graph, int *curtile)
       mapped = 0;
       for (k=0; k<GLOBAL_NUM; k++) {
         if (tile[i].global[k][0] == -1) {
-          mapped = MapStateToGlobal(&global[k], ext, 2*i, *curtile);
+          mapped = MapStateToGlobal(&global[k], ext, 2*i, *curtile, log);
           if (mapped) {
-            tile[i].global[k][0] = state;
+            JournalSet(log, &tile[i].global[k][0], state);
             break;
           }
         }
         else if (tile[i].global[k][1] == -1) {
-          mapped = MapStateToGlobal(&global[k], ext, 2*i+1, *curtile);
+          mapped = MapStateToGlobal(&global[k], ext, 2*i+1, *curtile, log);
           if (mapped) {
-            tile[i].global[k][1] = state;
+            JournalSet(log, &tile[i].global[k][1], state);
             break;
           }
         }
       }
       if (!mapped && g4 != NULL) {
-        for (k=0; k<8; k++) {
+        for (k=0; k<G4_WIDTH; k++) {
           if (tile[i].g4[k] == -1) {
-            mapped = MapStateToG4(g4, ext, 8*i+k, *curtile);
+            mapped = MapStateToG4(g4, ext, G4_WIDTH*i+k, *curtile, log);
             if (mapped) {
-              tile[i].g4[k] = state;
+              JournalSet(log, &tile[i].g4[k], state);
               break;
             }
           }
@@ -154,134 +169,168 @@ char MapGlobal(chip_t *chip, graph_t *graph, int *curtile)
 }
 
 /*
-* Copy the configuration of a global switch
+* Build the routes of a switch with *width* input rows per tile as a sparse
+* adjacency: the output columns of input row r are col[rowptr[r]..rowptr[r+1]).
+* src[j] is the input row that drives output column j, or negative if unused.
+* The cost is linear in the # of used routes plus the # of rows. Every row is
+* sorted, and a route reached through several ghost tiles appears repeatedly.
 */
-void CopyGlobal(global_t dest[GLOBAL_NUM], global_t src[GLOBAL_NUM])
+static void BuildSwitchRows(const int *src, int width, tile_t *tile,
+                            int **rowptr_out, int **col_out)
 {
-  int i, j;
-  for (i=0; i<GLOBAL_NUM; i++) {
-    for (j=0; j<TILE_NUM; j++) {
-      dest[i].src[j][0] = src[i].src[j][0];
-      dest[i].src[j][1] = src[i].src[j][1];
+  int nrow = width * TILE_NUM;
+  int *rowptr = (int*)calloc(nrow + 1, sizeof(int));
+  int *next = (int*)malloc(nrow * sizeof(int));
+  int *col;
+  list_t *ghost;
+  int j, l;
+
+  /* Count the routes that leave every input row, ghost copies included */
+  for (j=0; j<nrow; j++) {
+    if (src[j] < 0) {
+      continue;
+    }
+    rowptr[src[j] + 1]++;
+    ghost = tile[src[j] / width].ghost;
+    if (ghost) {
+      for (l=0; l<ghost->size; l++) {
+        rowptr[ghost->value[l] + src[j] % width + 1]++;
+      }
     }
   }
-}
+  for (j=0; j<nrow; j++) {
+    rowptr[j + 1] += rowptr[j];
+    next[j] = rowptr[j];
+  }
 
-/*
-* Copy the configuration of a 4-way global switch
-*/
-void CopyG4(g4_t *dest, g4_t *src)
-{
-  int i, j;
-  for (j=0; j<TILE_NUM; j++) {
-    for (i=0; i<8; i++) {
-      dest->src[j][i] = src->src[j][i];
+  /* Columns are visited in ascending order, so every row ends up sorted */
+  col = (int*)malloc((rowptr[nrow] + 1) * sizeof(int));
+  for (j=0; j<nrow; j++) {
+    if (src[j] < 0) {
+      continue;
+    }
+    col[next[src[j]]++] = j;
+    ghost = tile[src[j] / width].ghost;
+    if (ghost) {
+      for (l=0; l<ghost->size; l++) {
+        col[next[ghost->value[l] + src[j] % width]++] = j;
+      }
     }
   }
+
+  free(next);
+  *rowptr_out = rowptr;
+  *col_out = col;
 }
 
 /*
-* Write the configuration of a global switch to a file
+* Print the rows of a switch with *width* input rows per tile.
+* In compact mode rows without any route are left out.
 */
-void EmitGlobal(global_t global[GLOBAL_NUM], tile_t tile[TILE_NUM], FILE *fp)
+static void EmitSwitchRows(const int *src, int width, tile_t *tile, char compact,
+                           outbuf_t *out)
 {
-  char *bitmap = (char*)malloc(4 * TILE_NUM * TILE_NUM);
-  char ghost = 0;
-  int tsrc, row;
-  int i, j, k, l;
+  int nrow = width * TILE_NUM;
+  int *rowptr, *col;
+  int row, prev;
+  int j;
 
-  for (i=0; i<TILE_NUM; i++) {
-    if (tile[i].ghost) {
-      if (tile[i].ghost->size > 0) {
-        ghost = 1;
+  BuildSwitchRows(src, width, tile, &rowptr, &col);
+  for (row=0; row<nrow; row++) {
+    if (compact && rowptr[row] == rowptr[row + 1]) {
+      continue;
+    }
+    BufPutInt(out, row / width);
+    BufPutStr(out, "[");
+    BufPutInt(out, row % width);
+    BufPutStr(out, "]:");
+    prev = -1;
+    for (j=rowptr[row]; j<rowptr[row + 1]; j++) {
+      if (col[j] != prev) {
+        BufPutStr(out, " ");
+        BufPutInt(out, col[j] / width);
+        BufPutStr(out, "[");
+        BufPutInt(out, col[j] % width);
+        BufPutStr(out, "]");
+        prev = col[j];
       }
     }
+    BufPutStr(out, "\n");
   }
 
-  for (i=0; i<GLOBAL_NUM; i++) {
+  free(rowptr);
+  free(col);
+}
 
-    /* Store the configuration to bitmap */
-    memset(bitmap, 0, 4 * TILE_NUM * TILE_NUM);
-    for (j=0; j<TILE_NUM; j++) {
-      for (k=0; k<2; k++) {
-        if (global[i].src[j][k] != -1) {
-          bitmap[global[i].src[j][k] * TILE_NUM * 2 + j * 2 + k] = 1;
-          if (ghost) {
-            tsrc = global[i].src[j][k] / 2;
-            if (tile[tsrc].ghost) {
-              for (l=0; l<tile[tsrc].ghost->size; l++) {
-                row = tile[tsrc].ghost->value[l] + global[i].src[j][k] % 2;
-                bitmap[row * TILE_NUM * 2 + j * 2 + k] = 1;
-              }
-            }
-          }
-        }
-      }
-    }
+/*
+* Append the distinct routes of one switch to the *nroute* routes in *route*.
+* Returns the new # of routes.
+*/
+static int AddSwitchRoutes(const int *src, int width, tile_t *tile, unsigned sw,
+                           apmap_route_t **route, int nroute)
+{
+  int nrow = width * TILE_NUM;
+  int *rowptr, *col;
+  int row, prev;
+  int j;
 
-    /* Print the configuration according to the bitmap */
-    fprintf(fp, "\n--- Global Switch %d ---\n", i);
-    for (j=0; j<2*TILE_NUM; j++) {
-      fprintf(fp, "%d[%d]:", j / 2, j % 2);
-      for (k=0; k<2*TILE_NUM; k++) {
-        if (bitmap[j * TILE_NUM * 2 + k]) {
-          fprintf(fp, " %d[%d]", k / 2, k % 2);
-        }
+  BuildSwitchRows(src, width, tile, &rowptr, &col);
+  *route = (apmap_route_t*)realloc(*route, (nroute + rowptr[nrow] + 1) * sizeof(apmap_route_t));
+  for (row=0; row<nrow; row++) {
+    prev = -1;
+    for (j=rowptr[row]; j<rowptr[row + 1]; j++) {
+      if (col[j] != prev) {
+        (*route)[nroute].sw = sw;
+        (*route)[nroute].row = row;
+        (*route)[nroute].col = col[j];
+        nroute++;
+        prev = col[j];
       }
-      fprintf(fp, "\n");
     }
   }
-  free(bitmap);
+
+  free(rowptr);
+  free(col);
+  return nroute;
 }
 
 /*
-* Write the configuration of a 4-way global switch to a file
+* Collect the routes of all global switches of a chip, ordered by switch,
+* input row and output column. The 4-way switch has index GLOBAL_NUM.
+* Returns the # of routes; *route* must be freed by the caller.
 */
-void EmitG4(g4_t *g4, tile_t tile[TILE_NUM], FILE *fp)
+int CollectRoutes(chip_t *chip, apmap_route_t **route)
 {
-  char *bitmap = (char*)malloc(64 * TILE_NUM * TILE_NUM);
-  char ghost = 0;
-  int tsrc, row;
-  int i, j, k, l;
+  int nroute = 0;
+  int i;
 
-  for (i=0; i<TILE_NUM; i++) {
-    if (tile[i].ghost) {
-      if (tile[i].ghost->size > 0) {
-        ghost = 1;
-      }
-    }
+  *route = NULL;
+  for (i=0; i<GLOBAL_NUM; i++) {
+    nroute = AddSwitchRoutes(&chip->global[i].src[0][0], 2, chip->tile, i, route, nroute);
   }
-
-  /* Store the configuration to bitmap */
-  memset(bitmap, 0, 16 * TILE_NUM * TILE_NUM);
-  for (j=0; j<TILE_NUM; j++) {
-    for (k=0; k<8; k++) {
-      if (g4->src[j][k] != -1) {
-        bitmap[g4->src[j][k] * TILE_NUM * 8 + j * 8 + k] = 1;
-        if (ghost) {
-          tsrc = g4->src[j][k] / 8;
-          if (tile[tsrc].ghost) {
-            for (l=0; l<tile[tsrc].ghost->size; l++) {
-              row = tile[tsrc].ghost->value[l] + g4->src[j][k] % 8;
-              bitmap[row * TILE_NUM * 8 + j * 8 + k] = 1;
-            }
-          }
-        }
-      }
-    }
+  if (chip->g4 != NULL) {
+    nroute = AddSwitchRoutes(chip->g4->src, G4_WIDTH, chip->tile, GLOBAL_NUM, route, nroute);
   }
+  return nroute;
+}
 
-  /* Print the configuration according to the bitmap */
-  fprintf(fp, "\n--- Global-4 Switch ---\n");
-  for (j=0; j<8*TILE_NUM; j++) {
-    fprintf(fp, "%d[%d]:", j / 8, j % 8);
-    for (k=0; k<8*TILE_NUM; k++) {
-      if (bitmap[j * TILE_NUM * 8 + k]) {
-        fprintf(fp, " %d[%d]", k / 8, k % 8);
-      }
-    }
-    fprintf(fp, "\n");
-  }
-  free(bitmap);
+/*
+* Write the configuration of the *index*-th global switch to an output buffer
+*/
+void EmitGlobal(global_t *global, int index, tile_t *tile, char compact,
+                outbuf_t *out)
+{
+  BufPutStr(out, "\n--- Global Switch ");
+  BufPutInt(out, index);
+  BufPutStr(out, " ---\n");
+  EmitSwitchRows(&global->src[0][0], 2, tile, compact, out);
 }
 
+/*
+* Write the configuration of a 4-way global switch to an output buffer
+*/
+void EmitG4(g4_t *g4, tile_t *tile, char compact, outbuf_t *out)
+{
+  BufPutStr(out, "\n--- Global-4 Switch ---\n");
+  EmitSwitchRows(g4->src, G4_WIDTH, tile, compact, out);
+}
@@ -31,15 +31,14 @@ graph_t *CreateGraph(int nvtxs, int nedges, char extra)
     graph->where     = (int*)malloc(nvtxs * sizeof(int));
     graph->pos       = (int*)malloc(nvtxs * sizeof(int));
     graph->ext = (list_t**)malloc(nvtxs * sizeof(list_t*));
-    graph->name = (char**)malloc(nvtxs * sizeof(char*));;
+    graph->nameoff = (unsigned*)malloc(nvtxs * sizeof(unsigned));
     for (i=0; i<nvtxs; i++) {
       graph->ext[i] = NULL;
     }
 
-    graph->first = NULL;
-    graph->current = NULL;
-    graph->next = NULL;
-    graph->from = NULL;
+    graph->rxadj = NULL;
+    graph->radjncy = NULL;
+    graph->mark = NULL;
   }
   else {
     graph->ste = NULL;
@@ -48,12 +47,11 @@ graph_t *CreateGraph(int nvtxs, int nedges, char extra)
     graph->where = NULL;
     graph->pos = NULL;
     graph->ext = NULL;
-    graph->name = NULL;
+    graph->nameoff = NULL;
 
-    graph->first = (int*)malloc(nvtxs * sizeof(int));
-    graph->current = (int*)malloc(nvtxs * sizeof(int));
-    graph->next = (int*)malloc(nedges * sizeof(int));
-    graph->from = (int*)malloc(nedges * sizeof(int));
+    graph->rxadj = (int*)malloc((nvtxs+1) * sizeof(int));
+    graph->radjncy = (int*)malloc(nedges * sizeof(int));
+    graph->mark = (int*)malloc(nvtxs * sizeof(int));
   }
 
   return graph;
@@ -80,75 +78,64 @@ void FreeGraph(graph_t **r_graph, int nvtxs)
   free(graph->adjncy);
   free(graph->where);
   free(graph->pos);
-  free(graph->name);
+  free(graph->nameoff);
   free(graph->ste);
   free(graph->start);
   free(graph->report);
 
-  free(graph->first);
-  free(graph->current);
-  free(graph->next);
-  free(graph->from);
+  free(graph->rxadj);
+  free(graph->radjncy);
+  free(graph->mark);
   free(graph);
 
   *r_graph = NULL;
 }
 
 /*
-* Generate an undirected graph based on the given directed graph
+* Generate an undirected graph based on the given directed graph.
+* The neighbors of a state are its successors, followed by those of its
+* predecessors that are not also successors. Self-loops are left out.
+* The predecessors are grouped by a counting sort and checked against
+* marks of the successors, so it runs in O(V+E).
 */
-void *GetUndiGraph(graph_t *digraph, graph_t *graph)
+void GetUndiGraph(graph_t *digraph, graph_t *graph)
 {
   int nvtxs = digraph->nvtxs;
   int *dixadj = digraph->xadj;
   int *diadjncy = digraph->adjncy;
   int dinedges = dixadj[nvtxs];
 
-  int *from = graph->from;
-  int *current = graph->current;
-  int *first = graph->first;
-  int *next = graph->next;
+  int *rxadj = graph->rxadj;
+  int *radjncy = graph->radjncy;
+  int *mark = graph->mark;
   int *xadj = graph->xadj;
   int *adjncy = graph->adjncy;
-  int to, index;
-  char exist;
+  int from;
   int i, j, k;
 
-  for (i=0; i<nvtxs; i++) {
-    first[i] = -1;
-    current[i] = -1;
+  /* Predecessor lists, each in the order of the edges */
+  for (i=0; i<=nvtxs; i++) {
+    rxadj[i] = 0;
   }
-  for (i=0; i<dinedges; i++) {
-    next[i] = -1;
+  for (j=0; j<dinedges; j++) {
+    rxadj[diadjncy[j] + 1]++;
+  }
+  for (i=0; i<nvtxs; i++) {
+    rxadj[i+1] += rxadj[i];
   }
-
-  /* make the link */
   for (i=0; i<nvtxs; i++) {
     for (j=dixadj[i]; j<dixadj[i+1]; j++) {
-      to = diadjncy[j];
-
-      exist = 0;
-      for (k=dixadj[to]; k<dixadj[to+1]; k++) {
-        if (diadjncy[k] == i) {
-          exist = 1;
-          break;
-        }
-      }
-      if (exist) {
-        continue;
-      }
-
-      from[j] = i;
-      if (first[to] == -1) {
-        first[to] = j;
-        current[to] = j;
-      }
-      else {
-        next[current[to]] = j;
-        current[to] = j;
-      }
+      radjncy[rxadj[diadjncy[j]]++] = i;
     }
   }
+  for (i=nvtxs; i>0; i--) {
+    rxadj[i] = rxadj[i-1];
+  }
+  rxadj[0] = 0;
+
+  for (i=0; i<nvtxs; i++) {
+    mark[i] = -1;
+  }
 
   graph->nvtxs = nvtxs;
 
@@ -156,14 +143,16 @@ void *GetUndiGraph(graph_t *digraph, graph_t *graph)
   for (i=0; i<nvtxs; i++) {
     xadj[i] = k;
     for (j=dixadj[i]; j<dixadj[i+1]; j++) {
+      mark[diadjncy[j]] = i;
       if (diadjncy[j] != i) {
         adjncy[k] = diadjncy[j];
         k++;
       }
     }
-    for (index=first[i]; index!=-1; index=next[index]) {
-      if (from[index] != i) {
-        adjncy[k] = from[index];
+    for (j=rxadj[i]; j<rxadj[i+1]; j++) {
+      from = radjncy[j];
+      if (mark[from] != i) {
+        adjncy[k] = from;
         k++;
       }
     }
@@ -214,6 +203,61 @@ void CountBoundaryNodes(graph_t* graph, int *nin, int *nout)
   }
 }
 
+/*
+* CountBoundary for chips of *tilenum* tiles
+*/
+static GEOM_INLINE void CountBoundaryOf(graph_t *graph, const int *where, int npart, int *nin, int *nout,
+                                        int *mark, const int tilenum)
+{
+  int *xadj = graph->xadj;
+  int *adjncy = graph->adjncy;
+  int index, to_tile;
+  char external;
+  int i, j;
+
+  for (i=0; i<npart; i++) {
+    nin[i] = 0;
+    nout[i] = 0;
+  }
+  for (i=0; i<tilenum; i++) {
+    mark[i] = -1;
+  }
+
+  for (i=0; i<graph->nvtxs; i++) {
+    index = where[i];
+    external = 0;
+    for (j=xadj[i]; j<xadj[i+1]; j++) {
+      to_tile = where[adjncy[j]];
+      if (to_tile != index) {
+        external = 1;
+        if (mark[to_tile] != i) {
+          mark[to_tile] = i;
+          nin[to_tile]++;
+        }
+      }
+    }
+    if (external) {
+      nout[index]++;
+    }
+  }
+}
+
+/*
+* Count the # of the boundary nodes in every part of the partition *where*.
+* Unlike CountBoundaryNodes the graph is only read, so several partitions
+* can be counted at the same time. *mark* is scratch space for TILE_NUM ints.
+* The default geometry gets a copy with a constant # of tiles.
+*/
+void CountBoundary(graph_t *graph, const int *where, int npart, int *nin, int *nout, int *mark)
+{
+  if (TILE_NUM == DEF_TILE_NUM) {
+    CountBoundaryOf(graph, where, npart, nin, nout, mark, DEF_TILE_NUM);
+  }
+  else {
+    CountBoundaryOf(graph, where, npart, nin, nout, mark, TILE_NUM);
+  }
+}
+
 /*
 * Adjust *graph->ext* and *graph->where* as if the *pos* part is duplicated for *num* times
 */
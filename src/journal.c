@@ -0,0 +1,66 @@
+/*
+* Copyright (c) 2019, Delft University of Technology
+*
+* journal.c
+*
+* Undo log of the switch entries that a mapping attempt changes, so that
+* a failed attempt is rolled back in proportion to what it changed
+*/
+#include "apmapbin.h"
+
+/*
+* Initiate an empty journal
+*/
+void InitJournal(journal_t *log)
+{
+  log->size = 0;
+  log->maxsize = 64;
+  log->entry = (undo_t*)malloc(log->maxsize * sizeof(undo_t));
+}
+
+/*
+* Set *addr* to *value*, recording its old value
+*/
+void JournalSet(journal_t *log, int *addr, int value)
+{
+  if (*addr == value) {
+    return;
+  }
+  if (log->size == log->maxsize) {
+    log->maxsize *= 2;
+    log->entry = (undo_t*)realloc(log->entry, log->maxsize * sizeof(undo_t));
+  }
+  log->entry[log->size].addr = addr;
+  log->entry[log->size].old = *addr;
+  log->size++;
+  *addr = value;
+}
+
+/*
+* Keep the changes recorded so far
+*/
+void CommitJournal(journal_t *log)
+{
+  log->size = 0;
+}
+
+/*
+* Undo the changes recorded so far, the latest first
+*/
+void RollbackJournal(journal_t *log)
+{
+  while (log->size > 0) {
+    log->size--;
+    *log->entry[log->size].addr = log->entry[log->size].old;
+  }
+}
+
+/*
+* Release a journal
+*/
+void FreeJournal(journal_t *log)
+{
+  free(log->entry);
+  log->entry = NULL;
+  log->size = log->maxsize = 0;
+}
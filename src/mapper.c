@@ -0,0 +1,515 @@
+/*
+* Copyright (c) 2019, Delft University of Technology
+*
+* mapper.c
+*
+* Map a set of automata to the chips. Also the library entry point of Apmap.
+*/
+#include "apmapbin.h"
+#include <unistd.h>
+
+/*
+* Compare the sizes of automata. Needed by qsort
+*/
+int CompAutomata(const void *a, const void *b)
+{
+  int sizea = ((automata_t*)a)->nstate;
+  int sizeb = ((automata_t*)b)->nstate;
+  int edgea = ((automata_t*)a)->nedge;
+  int edgeb = ((automata_t*)b)->nedge;
+  if (sizea == sizeb) {
+    return edgeb - edgea;
+  }
+  else {
+    return sizeb - sizea;
+  }
+}
+
+/*
+* Set the default mapping options
+*/
+void InitMapOpt(mapopt_t *opt)
+{
+  opt->has_g4 = 1;
+  opt->no_opt = 0;
+  opt->readtext = MmapGraphFile;
+  opt->pfdepth = 4;
+  opt->pfthreads = 2;
+  opt->no_names = 0;
+  opt->compact = 0;
+  opt->emit = EMIT_TEXT;
+  opt->emitthreads = 4;
+  opt->split = 0;
+  opt->partthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  opt->partthreads = (opt->partthreads > 0)? opt->partthreads: 1;
+  opt->seed = -1;
+  opt->nseed = 1;
+  opt->nwin = 0;
+  opt->partitioner = PARTITIONER_METIS;
+  opt->refine = 1;
+  opt->portbal = 0;
+  opt->exhaustive = 0;
+  opt->ncall = 0;
+  opt->nsaved = 0;
+  opt->fastpath = 1;
+  opt->nfast = 0;
+  opt->cachedir = NULL;
+  opt->cachehit = 0;
+  opt->cachemiss = 0;
+  opt->dedup = 1;
+  opt->classes = NULL;
+  opt->ahead = 1;
+  opt->aheadtab = NULL;
+  opt->parchips = 0;
+  opt->fill = FILL_FFD;
+}
+
+/*
+* Map the small automaton at position *pos* of the stream to the current
+* tile of a chip
+*/
+static void FillTile(automata_t *automata, const int *idx, int pos, chip_t *chip,
+                     graph_t *graph, prefetch_t *prefetch, fillidx_t *fi, mapopt_t *opt)
+{
+  PrefetchGraph(prefetch, idx[pos], graph);
+  MapGraphToChip(chip, graph, graph, opt);
+  automata[idx[pos]].mapped = 1;
+  RemoveFillIndex(fi, pos);
+  fflush(stdout);
+}
+
+/*
+* Map a small graph best-fit: to the open tile of the chips with the
+* fewest free states that it fits in, or else first-fit to a fresh tile.
+* Returns the chip it is mapped to, or -1 if it fits on no chip.
+*/
+static int MapBestFit(roomidx_t *ri, chip_t *chip, int nchip, graph_t *graph, mapopt_t *opt)
+{
+  int room, tile, k;
+
+  room = TightestRoom(ri, graph->nvtxs, &k, &tile);
+  if (room == -1) {
+    for (k=0; k<nchip; k++) {
+      if (MapGraphToChip(&chip[k], graph, graph, opt) == 1) {
+        AddRoom(ri, k, chip[k].curtile, chip[k].remain);
+        return k;
+      }
+    }
+    return -1;
+  }
+
+  graph->npart = 1;
+  CopySmallGraphToTile(&chip[k].tile[tile], graph);
+  if (tile == chip[k].curtile) {
+    chip[k].remain -= graph->nvtxs;
+  }
+  AddRoom(ri, k, tile, room - graph->nvtxs);
+  return k;
+}
+
+/*
+* Map the automata idx[0..n-1], sorted by size, to the chips first-fit.
+* With FILL_FFD the rest of the last tile of every graph is filled with
+* the largest small graphs of the stream that fit. With FILL_BEST the
+* small graphs are left in the stream; as it is sorted, they come after
+* the large graphs and are mapped by MapBestFit. A graph that fits on no
+* chip is an error if *must* is set; otherwise it is left unmapped.
+* Returns the # of such graphs.
+*/
+static int MapStream(automata_t *automata, const int *idx, int n, chip_t *chip, int nchip,
+                     graph_t *graph, graph_t *ungraph, prefetch_t *prefetch, mapopt_t *opt,
+                     char must)
+{
+  fillidx_t *fi;
+  roomidx_t *ri = NULL;
+  char succeed = 0;
+  int nfail = 0;
+  int j, k;
+  int i;
+
+  if (n == 0) {
+    return 0;
+  }
+  fi = CreateFillIndex(automata, idx, n);
+
+  for (i=0; i<n; i++) {
+    if (automata[idx[i]].mapped) {
+      continue;
+    }
+
+    /* Read graph */
+    PrefetchGraph(prefetch, idx[i], graph);
+
+    if (opt->fill == FILL_BEST && graph->nvtxs <= TILE_SIZE) {
+      if (!ri) {
+        ri = CreateRoomIndex(chip, nchip);
+      }
+      k = MapBestFit(ri, chip, nchip, graph, opt);
+      succeed = (k != -1);
+    }
+    else {
+      for (k=0; k<nchip; k++) {
+        succeed = MapGraphToChip(&chip[k], graph, ungraph, opt);
+        if (succeed == 1) {
+          break;
+        }
+      }
+    }
+    /* A graph that fits on no chip is not offered to the fill either */
+    RemoveFillIndex(fi, i);
+    if (succeed != 1) {
+      if (must) {
+        errexit("%s cannot be mapped!\n", automata[idx[i]].fname);
+      }
+      nfail++;
+      continue;
+    }
+
+    automata[idx[i]].mapped = 1;
+    if (NextUnmapped(fi, i + 1) == -1) {
+      break;
+    }
+    if (opt->fill == FILL_BEST && graph->nvtxs <= TILE_SIZE) {
+      continue;
+    }
+
+    /* Fill the remaining part of a tile with small graphs */
+    if (opt->fill == FILL_FFD) {
+      while ((j = LargestFit(fi, chip[k].remain)) != -1) {
+        FillTile(automata, idx, j, &chip[k], graph, prefetch, fi, opt);
+      }
+    }
+    if (chip[k].remain < THRESHOLD)
+    {
+      chip[k].curtile++;
+      chip[k].remain = TILE_SIZE;
+    }
+  }
+
+  FreeFillIndex(fi);
+  if (ri) {
+    FreeRoomIndex(ri);
+  }
+  return nfail;
+}
+
+/*
+* Divide the sorted automata between *nchip* streams. Every automaton goes
+* to the stream with the fewest states so far, so that the chips are
+* equally full and every stream keeps its share of small graphs to fill
+* tiles with. stream[k] receives the indices of stream k, in order.
+*/
+static void SplitStreams(automata_t *automata, int ngraph, int nchip, int **stream, int *nstream)
+{
+  long long *load = (long long*)calloc(nchip, sizeof(long long));
+  int best;
+  int i, k;
+
+  for (k=0; k<nchip; k++) {
+    stream[k] = (int*)malloc((ngraph + 1) * sizeof(int));
+    nstream[k] = 0;
+  }
+  for (i=0; i<ngraph; i++) {
+    best = 0;
+    for (k=1; k<nchip; k++) {
+      if (load[k] < load[best]) {
+        best = k;
+      }
+    }
+    stream[best][nstream[best]++] = i;
+    load[best] += automata[i].nstate;
+  }
+  free(load);
+}
+
+/*
+* Thread that maps the stream of one chip
+*/
+static void *ChipWorker(void *arg)
+{
+  chipjob_t *job = (chipjob_t*)arg;
+  graph_t *graph = CreateGraph(job->automata[0].nstate, job->maxedge, 1);
+  graph_t *ungraph = CreateGraph(job->automata[0].nstate, job->maxedge * 2, 0);
+
+  graph->names = job->chip->names;
+  job->nfail = MapStream(job->automata, job->idx, job->n, job->chip, 1, graph, ungraph,
+                         job->prefetch, &job->opt, 0);
+  FreeGraph(&graph, job->automata[0].nstate);
+  FreeGraph(&ungraph, job->automata[0].nstate);
+  return NULL;
+}
+
+/*
+* Map every chip on its own thread, each with its share of the automata.
+* The automata that do not fit on their chip are left unmapped.
+* Returns their #.
+*/
+static int MapChipsInParallel(automata_t *automata, int ngraph, int maxedge, chip_t *chip,
+                              prefetch_t *prefetch, mapopt_t *opt)
+{
+  chipjob_t *job = (chipjob_t*)malloc(CHIP_NUM * sizeof(chipjob_t));
+  pthread_t *thread = (pthread_t*)malloc(CHIP_NUM * sizeof(pthread_t));
+  int **stream = (int**)malloc(CHIP_NUM * sizeof(int*));
+  int *nstream = (int*)malloc(CHIP_NUM * sizeof(int));
+  int nfail = 0;
+  int k;
+
+  SplitStreams(automata, ngraph, CHIP_NUM, stream, nstream);
+  ParallelMetis(1);
+  for (k=0; k<CHIP_NUM; k++) {
+    job[k].automata = automata;
+    job[k].idx = stream[k];
+    job[k].n = nstream[k];
+    job[k].chip = &chip[k];
+    job[k].prefetch = prefetch;
+    job[k].maxedge = maxedge;
+    job[k].opt = *opt;
+    job[k].opt.partthreads = (opt->partthreads > CHIP_NUM)? opt->partthreads / CHIP_NUM: 1;
+    job[k].opt.ncall = job[k].opt.nsaved = job[k].opt.nwin = job[k].opt.nfast = 0;
+    job[k].opt.cachehit = job[k].opt.cachemiss = 0;
+    if (k > 0 && pthread_create(&thread[k], NULL, ChipWorker, &job[k]) != 0) {
+      errexit("Cannot create chip thread %d!\n", k);
+    }
+  }
+  ChipWorker(&job[0]);
+  for (k=1; k<CHIP_NUM; k++) {
+    pthread_join(thread[k], NULL);
+  }
+  ParallelMetis(0);
+  for (k=0; k<CHIP_NUM; k++) {
+    nfail += job[k].nfail;
+    opt->ncall += job[k].opt.ncall;
+    opt->nsaved += job[k].opt.nsaved;
+    opt->nwin += job[k].opt.nwin;
+    opt->nfast += job[k].opt.nfast;
+    opt->cachehit += job[k].opt.cachehit;
+    opt->cachemiss += job[k].opt.cachemiss;
+    free(stream[k]);
+  }
+  free(stream);
+  free(nstream);
+  free(thread);
+  free(job);
+  return nfail;
+}
+
+/*
+* Map all automata to the chips and write the configuration to *outfile*.
+* A binary configuration goes to *outfile* with the .apc extension.
+* The automata array is sorted in place. Returns the # of tiles used.
+* With opt->parchips the automata are first divided between the chips,
+* which are then mapped at the same time; the ones that do not fit on
+* their chip are mapped first-fit afterwards.
+*/
+float MapAutomata(automata_t *automata, int ngraph, mapopt_t *opt, const char *outfile)
+{
+  graph_t *graph, *ungraph;
+  arena_t *names;
+  unsigned nextid;
+  int maxedge;
+  chip_t *chip;
+  prefetch_t *prefetch;
+  int *idx;
+  int nleft, nspill;
+  long long nstate;
+  float ntile;
+  char *apcname;
+  int i, k;
+
+  /* Sort the automata */
+  qsort(automata, ngraph, sizeof(automata_t), CompAutomata);
+
+  maxedge = automata[0].nedge;
+  nextid = 0;
+  for (i=0; i<ngraph; i++) {
+    automata[i].mapped = 0;
+    automata[i].firstid = nextid;
+    nextid += automata[i].nstate;
+    maxedge = (automata[i].nedge>maxedge)? automata[i].nedge: maxedge;
+  }
+  names = opt->no_names? NULL: CreateArena(nextid * 8);
+  graph = CreateGraph(automata[0].nstate, maxedge, 1);
+  graph->names = names;
+  ungraph = CreateGraph(automata[0].nstate, maxedge * 2, 0);
+
+  if (opt->ahead) {
+    PartitionAhead(automata, ngraph, maxedge, opt);
+  }
+
+  prefetch = CreatePrefetch(automata, ngraph, opt->readtext, opt->pfdepth, opt->pfthreads,
+                            automata[0].nstate, maxedge, names);
+
+  chip = (chip_t*)malloc(CHIP_NUM * sizeof(chip_t));
+  for (i=0; i<CHIP_NUM; i++) {
+    ChipInit(&chip[i], opt->has_g4);
+    chip[i].names = names;
+  }
+  opt->classes = opt->dedup? CreateClassTable(): NULL;
+
+  idx = (int*)malloc((ngraph + 1) * sizeof(int));
+  nspill = 0;
+  if (opt->parchips && CHIP_NUM > 1) {
+    nspill = MapChipsInParallel(automata, ngraph, maxedge, chip, prefetch, opt);
+  }
+  nleft = 0;
+  for (i=0; i<ngraph; i++) {
+    if (!automata[i].mapped) {
+      idx[nleft++] = i;
+    }
+  }
+  MapStream(automata, idx, nleft, chip, CHIP_NUM, graph, ungraph, prefetch, opt, 1);
+  free(idx);
+
+  FreePrefetch(prefetch);
+
+  /* Report chip utilization */
+  ntile = 0;
+  for (k=0; k<CHIP_NUM; k++) {
+    if (chip[k].remain == TILE_SIZE) {
+      ntile += chip[k].curtile;
+    }
+    else {
+      ntile += chip[k].curtile + 1 - (float)chip[k].remain / TILE_SIZE;
+    }
+  }
+  printf("%.1f tiles in total\n", ntile);
+  if (opt->parchips && CHIP_NUM > 1) {
+    nstate = 0;
+    for (i=0; i<ngraph; i++) {
+      nstate += automata[i].nstate;
+    }
+    /* Serial first-fit needs at least the lower bound, so this bounds the gap to it */
+    printf("Chips mapped in parallel: at most %.1f tiles more than serial first-fit"
+           " (lower bound %.1f tiles)", ntile - (float)nstate / TILE_SIZE,
+           (float)nstate / TILE_SIZE);
+    printf(", %d graphs did not fit on their chip\n", nspill);
+  }
+  if (opt->cachedir) {
+    printf("Partition cache: %d hits, %d misses\n", opt->cachehit, opt->cachemiss);
+  }
+  if (opt->ncall > 0) {
+    if (opt->exhaustive || opt->no_opt) {
+      printf("Partitioner calls: %d\n", opt->ncall);
+    }
+    else {
+      printf("Partitioner calls: %d (%d saved by the guided search)\n", opt->ncall, opt->nsaved);
+    }
+  }
+  if (opt->nseed > 1) {
+    printf("Seed races: %d won by another seed than %d\n", opt->nwin, opt->seed);
+  }
+  if (opt->nfast > 0) {
+    printf("%d graphs partitioned in topological order\n", opt->nfast);
+  }
+  if (opt->aheadtab) {
+    printf("%d of %d partitions computed ahead were used\n",
+           opt->aheadtab->nreuse, opt->aheadtab->ncls);
+  }
+  if (opt->classes && opt->classes->nreuse > 0) {
+    printf("%d partitions reused from identical graphs\n", opt->classes->nreuse);
+  }
+  fflush(stdout);
+
+  /* Emit mapping result */
+  if (opt->emit & EMIT_TEXT) {
+    EmitChips(chip, CHIP_NUM, opt, outfile);
+  }
+  if (opt->emit & EMIT_BINARY) {
+    apcname = (char*)malloc(strlen(outfile) + 5);
+    sprintf(apcname, "%s.apc", outfile);
+    WriteApcFile(chip, CHIP_NUM, apcname);
+    free(apcname);
+  }
+
+  /* Release resources */
+  FreeGraph(&graph, automata[0].nstate);
+  FreeGraph(&ungraph, automata[0].nstate);
+  for (i=0; i<CHIP_NUM; i++) {
+    FreeChip(&chip[i]);
+  }
+  free(chip);
+  FreeArena(names);
+  FreeClassTable(opt->classes);
+  FreeClassTable(opt->aheadtab);
+  opt->aheadtab = NULL;
+  opt->classes = NULL;
+  return ntile;
+}
+
+/*
+* Check a connected component handed over by a library call, so that
+* copying and mapping it stays within its arrays. The names are kept, so
+* every state needs one.
+*/
+static void CheckCC(const apmap_cc_t *cc, int index)
+{
+  int i;
+
+  if (cc->nstate < 1 || cc->nedge < 0) {
+    errexit("CC %d has %d states and %d edges.\n", index, cc->nstate, cc->nedge);
+  }
+  if (!cc->xadj || (cc->nedge > 0 && !cc->adjncy) || !cc->ste || !cc->start ||
+      !cc->report || !cc->name) {
+    errexit("CC %d misses an array.\n", index);
+  }
+  if (cc->xadj[0] != 0 || cc->xadj[cc->nstate] != cc->nedge) {
+    errexit("Corrupted adjacency index in CC %d.\n", index);
+  }
+  for (i=0; i<cc->nstate; i++) {
+    if (cc->xadj[i] > cc->xadj[i+1]) {
+      errexit("Corrupted adjacency index of state %d in CC %d.\n", i, index);
+    }
+    if (!cc->name[i]) {
+      errexit("State %d in CC %d has no name.\n", i, index);
+    }
+  }
+  for (i=0; i<cc->nedge; i++) {
+    if (cc->adjncy[i] < 0 || cc->adjncy[i] >= cc->nstate) {
+      errexit("Edge %d in CC %d is out of bounds\n", cc->adjncy[i] + 1, index);
+    }
+  }
+}
+
+/*
+* Library entry point. Map connected components that are already in memory.
+* Invalid components are rejected before anything is mapped.
+*/
+float ApmapMapCC(const apmap_cc_t *cc, int ncc, int has_g4, int no_opt, const char *outfile)
+{
+  automata_t *automata;
+  mapopt_t opt;
+  float ntile;
+  int i;
+
+  if (ncc <= 0) {
+    errexit("No connected component to map.\n");
+  }
+  for (i=0; i<ncc; i++) {
+    CheckCC(&cc[i], i);
+  }
+
+  InitMapOpt(&opt);
+  opt.has_g4 = has_g4;
+  opt.no_opt = no_opt;
+  opt.pfdepth = 0; /* Nothing to parse */
+
+  automata = (automata_t*)malloc(ncc * sizeof(automata_t));
+  for (i=0; i<ncc; i++) {
+    automata[i].nstate = cc[i].nstate;
+    automata[i].nedge = cc[i].nedge;
+    automata[i].fname = (char*)malloc(16);
+    sprintf(automata[i].fname, "CC%d", i);
+    automata[i].data = NULL;
+    automata[i].length = 0;
+    automata[i].cc = &cc[i];
+    automata[i].firstid = 0;
+  }
+
+  ntile = MapAutomata(automata, ncc, &opt, outfile);
+
+  for (i=0; i<ncc; i++) {
+    free(automata[i].fname);
+  }
+  free(automata);
+  return ntile;
+}
@@ -0,0 +1,356 @@
+/*
+* Copyright (c) 2019, Delft University of Technology
+*
+* multilevel.c
+*
+* A multilevel graph partitioner that knows about the tile constraints.
+* The graph is coarsened by heavy-edge matching, divided at the coarsest
+* level and refined on the way back. The coarse levels are refined on the
+* edge cut, as Metis does; the final level is refined on the overhead of
+* the tile ports, which is what the mapping actually pays for (refine.c).
+*/
+#include "apmapbin.h"
+
+/* Coarsening stops at this many vertices per part */
+#define ML_COARSEN_TO 16
+
+/* The largest weight of a coarse vertex */
+#define ML_MAXVWGT (TILE_SIZE / 8)
+
+/* The largest # of levels */
+#define ML_MAXLEVEL 32
+
+/* The largest # of refinement passes at each level */
+#define ML_NPASS 8
+
+/*
+* Create a level with room for *nvtxs* vertices and *nedges* edges
+*/
+static mlgraph_t *CreateLevel(int nvtxs, int nedges)
+{
+  mlgraph_t *g = (mlgraph_t*)malloc(sizeof(mlgraph_t));
+
+  g->nvtxs = nvtxs;
+  g->xadj = (int*)malloc((nvtxs + 1) * sizeof(int));
+  g->adjncy = (int*)malloc((nedges + 1) * sizeof(int));
+  g->adjwgt = (int*)malloc((nedges + 1) * sizeof(int));
+  g->vwgt = (int*)malloc((nvtxs + 1) * sizeof(int));
+  g->cmap = (int*)malloc((nvtxs + 1) * sizeof(int));
+  return g;
+}
+
+/*
+* Free a level
+*/
+static void FreeLevel(mlgraph_t *g)
+{
+  free(g->xadj);
+  free(g->adjncy);
+  free(g->adjwgt);
+  free(g->vwgt);
+  free(g->cmap);
+  free(g);
+}
+
+/*
+* Build the finest level from the undirected graph
+*/
+static mlgraph_t *FirstLevel(graph_t *ungraph)
+{
+  int nvtxs = ungraph->nvtxs;
+  int nedges = ungraph->xadj[nvtxs];
+  mlgraph_t *g = CreateLevel(nvtxs, nedges);
+  int i;
+
+  memcpy(g->xadj, ungraph->xadj, (nvtxs + 1) * sizeof(int));
+  memcpy(g->adjncy, ungraph->adjncy, nedges * sizeof(int));
+  for (i=0; i<nedges; i++) {
+    g->adjwgt[i] = 1;
+  }
+  for (i=0; i<nvtxs; i++) {
+    g->vwgt[i] = 1;
+  }
+  return g;
+}
+
+/*
+* Coarsen a level by heavy-edge matching. Fills g->cmap.
+* Returns NULL if the level hardly shrinks.
+*/
+static mlgraph_t *Coarsen(mlgraph_t *g)
+{
+  int nvtxs = g->nvtxs;
+  int *xadj = g->xadj;
+  int *adjncy = g->adjncy;
+  int *adjwgt = g->adjwgt;
+  int *vwgt = g->vwgt;
+  int *cmap = g->cmap;
+  int *match = (int*)malloc(nvtxs * sizeof(int));
+  int *mark;
+  mlgraph_t *cg;
+  int cnvtxs, cnedges;
+  int best, maxwgt;
+  int c, k, v;
+  int i, j, m;
+
+  for (i=0; i<nvtxs; i++) {
+    match[i] = -1;
+  }
+  cnvtxs = 0;
+  for (i=0; i<nvtxs; i++) {
+    if (match[i] != -1) {
+      continue;
+    }
+    best = i;
+    maxwgt = 0;
+    for (j=xadj[i]; j<xadj[i+1]; j++) {
+      k = adjncy[j];
+      if (k != i && match[k] == -1 && adjwgt[j] > maxwgt && vwgt[i] + vwgt[k] <= ML_MAXVWGT) {
+        best = k;
+        maxwgt = adjwgt[j];
+      }
+    }
+    match[i] = best;
+    match[best] = i;
+    cmap[i] = cmap[best] = cnvtxs++;
+  }
+  if (cnvtxs > nvtxs * 0.9) {
+    free(match);
+    return NULL;
+  }
+
+  /* Merge the adjacency lists of every matched pair */
+  cg = CreateLevel(cnvtxs, xadj[nvtxs]);
+  mark = (int*)malloc(cnvtxs * sizeof(int));
+  for (c=0; c<cnvtxs; c++) {
+    mark[c] = -1;
+  }
+  cnedges = 0;
+  for (i=0; i<nvtxs; i++) {
+    if (match[i] < i) {
+      continue;
+    }
+    c = cmap[i];
+    cg->xadj[c] = cnedges;
+    cg->vwgt[c] = 0;
+    for (m=0; m<2; m++) {
+      v = (m == 0)? i: match[i];
+      if (m == 1 && v == i) {
+        break;
+      }
+      cg->vwgt[c] += vwgt[v];
+      for (j=xadj[v]; j<xadj[v+1]; j++) {
+        k = cmap[adjncy[j]];
+        if (k == c) {
+          continue;
+        }
+        if (mark[k] < cg->xadj[c]) {
+          mark[k] = cnedges;
+          cg->adjncy[cnedges] = k;
+          cg->adjwgt[cnedges] = adjwgt[j];
+          cnedges++;
+        }
+        else {
+          cg->adjwgt[mark[k]] += adjwgt[j];
+        }
+      }
+    }
+  }
+  cg->xadj[cnvtxs] = cnedges;
+
+  free(mark);
+  free(match);
+  return cg;
+}
+
+/*
+* Divide the coarsest level. The vertices are laid out in breadth-first
+* order and every vertex goes to the first part that has room for it.
+*/
+static void InitialPartition(mlgraph_t *g, int npart, const int *cap, int *where, int *size)
+{
+  int nvtxs = g->nvtxs;
+  int *order = (int*)malloc(nvtxs * sizeof(int));
+  int head, tail;
+  int first, p, q, v;
+  int i, j;
+
+  for (i=0; i<nvtxs; i++) {
+    where[i] = -1;
+  }
+  head = tail = 0;
+  for (i=0; i<nvtxs; i++) {
+    if (where[i] != -1) {
+      continue;
+    }
+    where[i] = 0;
+    order[tail++] = i;
+    while (head < tail) {
+      v = order[head++];
+      for (j=g->xadj[v]; j<g->xadj[v+1]; j++) {
+        if (where[g->adjncy[j]] == -1) {
+          where[g->adjncy[j]] = 0;
+          order[tail++] = g->adjncy[j];
+        }
+      }
+    }
+  }
+
+  for (p=0; p<npart; p++) {
+    size[p] = 0;
+  }
+  first = 0;
+  for (i=0; i<nvtxs; i++) {
+    v = order[i];
+    while (first < npart - 1 && size[first] >= cap[first]) {
+      first++;
+    }
+    for (p=first; p<npart; p++) {
+      if (size[p] + g->vwgt[v] <= cap[p]) {
+        break;
+      }
+    }
+    if (p == npart) {
+      /* Spill into the part with the most room; refinement fixes an overflow */
+      p = first;
+      for (q=first; q<npart; q++) {
+        if (cap[q] - size[q] > cap[p] - size[p]) {
+          p = q;
+        }
+      }
+    }
+    where[v] = p;
+    size[p] += g->vwgt[v];
+  }
+  free(order);
+}
+
+/*
+* Move boundary vertices of a level to the parts they are most connected to.
+* A move has to reduce the edge cut, or keep it and take states out of the
+* last part, so that the tail of the graph stays small, or relieve an
+* overfull part.
+*/
+static void RefineCut(mlgraph_t *g, int npart, const int *cap, int *where, int *size)
+{
+  int nvtxs = g->nvtxs;
+  int *conn = (int*)calloc(npart, sizeof(int));
+  int *touched = (int*)malloc(npart * sizeof(int));
+  int ntouched;
+  int a, b, best, gain, bestgain;
+  char moved, over;
+  int pass, v, i, j;
+
+  for (pass=0; pass<ML_NPASS; pass++) {
+    moved = 0;
+    for (v=0; v<nvtxs; v++) {
+      a = where[v];
+      ntouched = 0;
+      for (j=g->xadj[v]; j<g->xadj[v+1]; j++) {
+        b = where[g->adjncy[j]];
+        if (conn[b] == 0) {
+          touched[ntouched++] = b;
+        }
+        conn[b] += g->adjwgt[j];
+      }
+
+      over = size[a] > cap[a];
+      best = -1;
+      bestgain = 0;
+      for (i=0; i<ntouched; i++) {
+        b = touched[i];
+        if (b == a || size[b] + g->vwgt[v] > cap[b]) {
+          continue;
+        }
+        gain = conn[b] - conn[a];
+        if ((best == -1 && (gain > 0 || over ||
+                            (gain == 0 && a == npart - 1))) ||
+            (best != -1 && gain > bestgain)) {
+          best = b;
+          bestgain = gain;
+        }
+      }
+      if (best != -1) {
+        where[v] = best;
+        size[a] -= g->vwgt[v];
+        size[best] += g->vwgt[v];
+        moved = 1;
+      }
+
+      for (i=0; i<ntouched; i++) {
+        conn[touched[i]] = 0;
+      }
+    }
+    if (!moved) {
+      break;
+    }
+  }
+  free(conn);
+  free(touched);
+}
+
+/*
+* Divide a graph into *npart* parts without Metis.
+* Part 0 holds at most *headsize* states, the last part at most *tailsize*
+* states and the others at most TILE_SIZE states. These are hard limits,
+* unlike the target weights of Metis.
+* Returns whether the partition satisfies the tile size constraint, as
+* MetisWrapper does. Only reads the graphs, so it can run in several
+* threads at once.
+*/
+char NativePartition(graph_t *ungraph, graph_t *graph, int npart, int headsize, int tailsize,
+                     char has_g4, int *part)
+{
+  int nvtxs = ungraph->nvtxs;
+  mlgraph_t *level[ML_MAXLEVEL];
+  int *where[ML_MAXLEVEL];
+  int *cap = (int*)malloc(npart * sizeof(int));
+  int *size = (int*)malloc(npart * sizeof(int));
+  mlgraph_t *cg;
+  int nlevel;
+  int i, l;
+
+  for (i=0; i<npart; i++) {
+    cap[i] = TILE_SIZE;
+  }
+  if (npart > 1) {
+    cap[npart-1] = (tailsize < TILE_SIZE)? tailsize: TILE_SIZE;
+  }
+  cap[0] = (headsize < TILE_SIZE)? headsize: TILE_SIZE;
+
+  /* Coarsen */
+  level[0] = FirstLevel(ungraph);
+  nlevel = 1;
+  while (nlevel < ML_MAXLEVEL && level[nlevel-1]->nvtxs > ML_COARSEN_TO * npart) {
+    cg = Coarsen(level[nlevel-1]);
+    if (!cg) {
+      break;
+    }
+    level[nlevel++] = cg;
+  }
+
+  /* Divide the coarsest level, then project and refine level by level */
+  where[0] = part;
+  for (l=1; l<nlevel; l++) {
+    where[l] = (int*)malloc(level[l]->nvtxs * sizeof(int));
+  }
+  InitialPartition(level[nlevel-1], npart, cap, where[nlevel-1], size);
+  RefineCut(level[nlevel-1], npart, cap, where[nlevel-1], size);
+  for (l=nlevel-2; l>=0; l--) {
+    for (i=0; i<level[l]->nvtxs; i++) {
+      where[l][i] = where[l+1][level[l]->cmap[i]];
+    }
+    RefineCut(level[l], npart, cap, where[l], size);
+  }
+  RefinePartition(ungraph, graph, npart, cap, has_g4, part);
+
+  for (l=0; l<nlevel; l++) {
+    if (l > 0) {
+      free(where[l]);
+    }
+    FreeLevel(level[l]);
+  }
+  free(cap);
+  free(size);
+  return CheckPartSize(part, nvtxs, npart, headsize);
+}
@@ -0,0 +1,130 @@
+/*
+* Copyright (c) 2019, Delft University of Technology
+*
+* outbuf.c
+*
+* Functions related to the output buffer used for writing the mapping result
+*/
+#include "apmapbin.h"
+
+/*
+* Initiate an output buffer of *size* bytes.
+* With a file the buffer is written out whenever it is full;
+* without one (fp is NULL) it grows to hold all of the text.
+*/
+void InitOutBuf(outbuf_t *out, FILE *fp, size_t size)
+{
+  out->maxsize = (size > 64)? size: 64;
+  out->buf = (char*)malloc(out->maxsize);
+  out->size = 0;
+  out->fp = fp;
+}
+
+/*
+* Write the buffered text to the file, if there is one
+*/
+void FlushOutBuf(outbuf_t *out)
+{
+  if (out->fp && out->size > 0) {
+    if (fwrite(out->buf, 1, out->size, out->fp) != out->size) {
+      errexit("Cannot write the mapping result!\n");
+    }
+    out->size = 0;
+  }
+}
+
+/*
+* Make room for *len* more bytes
+*/
+static void ReserveOutBuf(outbuf_t *out, size_t len)
+{
+  if (out->size + len <= out->maxsize) {
+    return;
+  }
+  FlushOutBuf(out);
+  while (out->size + len > out->maxsize) {
+    out->maxsize *= 2;
+  }
+  out->buf = (char*)realloc(out->buf, out->maxsize);
+  if (!out->buf) {
+    errexit("Cannot grow the output buffer to %lu bytes!\n", (unsigned long)out->maxsize);
+  }
+}
+
+/*
+* Append a string
+*/
+void BufPutStr(outbuf_t *out, const char *str)
+{
+  size_t len = strlen(str);
+
+  ReserveOutBuf(out, len);
+  memcpy(out->buf + out->size, str, len);
+  out->size += len;
+}
+
+/*
+* Append a decimal integer, as printf("%d") does
+*/
+void BufPutInt(outbuf_t *out, int num)
+{
+  char digit[12];
+  unsigned val = (num < 0)? 0u - (unsigned)num: (unsigned)num;
+  int n = 0;
+
+  ReserveOutBuf(out, 12);
+  do {
+    digit[n++] = '0' + val % 10;
+    val /= 10;
+  } while (val > 0);
+  if (num < 0) {
+    out->buf[out->size++] = '-';
+  }
+  while (n > 0) {
+    out->buf[out->size++] = digit[--n];
+  }
+}
+
+/*
+* Append an unsigned decimal integer, as printf("%u") does
+*/
+void BufPutUnsigned(outbuf_t *out, unsigned num)
+{
+  char digit[12];
+  int n = 0;
+
+  ReserveOutBuf(out, 12);
+  do {
+    digit[n++] = '0' + num % 10;
+    num /= 10;
+  } while (num > 0);
+  while (n > 0) {
+    out->buf[out->size++] = digit[--n];
+  }
+}
+
+/*
+* Append a 32-bit word as 8 upper-case hex digits, as printf("%08X") does
+*/
+void BufPutHex(outbuf_t *out, unsigned num)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  int i;
+
+  ReserveOutBuf(out, 8);
+  for (i=7; i>=0; i--) {
+    out->buf[out->size + i] = hex[num & 0xF];
+    num >>= 4;
+  }
+  out->size += 8;
+}
+
+/*
+* Flush and free an output buffer
+*/
+void FreeOutBuf(outbuf_t *out)
+{
+  FlushOutBuf(out);
+  free(out->buf);
+  out->buf = NULL;
+}
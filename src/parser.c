@@ -8,19 +8,31 @@
 
 #include "apmapbin.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /*
-* Read a map file, which defines a full automaton
+* Read a map file, which defines a full automaton.
+* A bundled archive (.apb) can be given instead of a text map file.
 */
 automata_t *ReadMapFile(FILE *fpin, int *ngraph)
 {
   size_t lnlen = 1024;
-  char *line = (char*)malloc(1024);
+  char *line;
+  char magic[4];
   automata_t *automata;
   int rlen;
   char nfields;
   int i;
 
+  if (fread(magic, 1, 4, fpin) == 4 && memcmp(magic, APB_MAGIC, 4) == 0) {
+    return ReadBundleIndex(fpin, ngraph);
+  }
+  rewind(fpin);
+  line = (char*)malloc(1024);
+
   /* Skip comment lines until you get to the first valid line */
   do {
     if (getline(&line, &lnlen, fpin) == -1) 
@@ -54,11 +66,31 @@ automata_t *ReadMapFile(FILE *fpin, int *ngraph)
     /* Copy the graph file name */
     automata[i].fname = (char*)malloc(rlen + 1);
     sscanf(line + nfields + 2, "%s", automata[i].fname);
+    automata[i].data = NULL;
+    automata[i].length = 0;
+    automata[i].cc = NULL;
+    automata[i].firstid = 0;
   }
 
+  free(line);
   return automata;
 }
 
+/*
+* Tell the user that the edge count in the .map file is wrong, then quit
+*/
+static void ReportEdgeMismatch(int nedges, int found)
+{
+  printf("------------------------------------------------------------------------------\n");
+  printf("***  I detected an error in your input file  ***\n\n");
+  printf("In the .map file, you specified that the graph contained\n"
+         "%d edges. However, I only found %d edges in the file.\n", 
+         nedges, found);
+  printf("Please specify the correct number of edges in the .map file.\n");
+  printf("------------------------------------------------------------------------------\n");
+  exit(0);
+}
+
 /*
 * Read a graph file, which is a connected component of an automaton
 * Modified based on the ReadGraph function of Metis.
@@ -70,10 +102,10 @@ void ReadGraphFile(graph_t *graph, const char *file, int nvtxs, int nedges)
   char *line = (char*)malloc(1024);
   int *xadj = graph->xadj;
   int *adjncy = graph->adjncy;
-  int *ste = graph->ste;
+  unsigned *ste = graph->ste;
   char *start = graph->start;
   char *report = graph->report;
-  char **name = graph->name;
+  unsigned *nameoff = graph->nameoff;
   int edge;
   char *curstr, *newstr;
   char nfields;
@@ -106,9 +138,9 @@ void ReadGraphFile(graph_t *graph, const char *file, int nvtxs, int nedges)
         errexit("STE pattern is not complete at the %d line of file %s.\n", i, file);
       }
     }
-    name[i] = (char*)malloc(j + 1);
-    strncpy(name[i], curstr, j);
-    name[i][j] = '\0';
+    if (graph->names) {
+      nameoff[i] = ArenaAdd(graph->names, curstr, j);
+    }
     curstr += j + 1;
 
     /* Read START field */
@@ -159,17 +191,305 @@ void ReadGraphFile(graph_t *graph, const char *file, int nvtxs, int nedges)
   }
 
   if (k != nedges) {
-    printf("------------------------------------------------------------------------------\n");
-    printf("***  I detected an error in your input file  ***\n\n");
-    printf("In the .map file, you specified that the graph contained\n"
-           "%d edges. However, I only found %d edges in the file.\n", 
-           nedges, k);
-    printf("Please specify the correct number of edges in the .map file.\n");
-    printf("------------------------------------------------------------------------------\n");
-    exit(0);
+    ReportEdgeMismatch(nedges, k);
   }
 
   fclose(fpin);
   free(line);
 }
 
+
+/*
+* Skip spaces, tabs and carriage returns, but stop at the end of a line
+*/
+static const char *SkipBlank(const char *cur, const char *end)
+{
+  while (cur < end && (*cur == ' ' || *cur == '\t' || *cur == '\r')) {
+    cur++;
+  }
+  return cur;
+}
+
+/*
+* Return the value of a hexadecimal digit, or -1 if c is not one
+*/
+static int HexValue(char c)
+{
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+/*
+* Map a whole file into memory for reading. Returns NULL for an empty file
+* and for a failure, which is described in *error*.
+*/
+static const char *MapFileOrFail(const char *file, size_t *size, const char **error)
+{
+  const char *buf;
+  struct stat st;
+  int fd;
+
+  *error = NULL;
+  *size = 0;
+  fd = open(file, O_RDONLY);
+  if (fd < 0) {
+    *error = "Cannot open file";
+    return NULL;
+  }
+  if (fstat(fd, &st) != 0) {
+    *error = "Cannot stat file";
+    close(fd);
+    return NULL;
+  }
+  *size = st.st_size;
+  if (*size == 0) {
+    close(fd);
+    return NULL;
+  }
+  buf = (const char*)mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (buf == MAP_FAILED) {
+    *error = "Cannot map file";
+    *size = 0;
+    return NULL;
+  }
+  madvise((void*)buf, *size, MADV_SEQUENTIAL);
+  return buf;
+}
+
+/*
+* Map a whole file into memory for reading. Returns NULL for an empty file.
+*/
+const char *MapFile(const char *file, size_t *size)
+{
+  const char *error;
+  const char *buf = MapFileOrFail(file, size, &error);
+
+  if (error) {
+    errexit("%s \"%s\"!\n", error, file);
+  }
+  return buf;
+}
+
+/*
+* MapFile for the library: a failure is reported on stderr and NULL is
+* returned, as for an empty file.
+*/
+const char *TryMapFile(const char *file, size_t *size)
+{
+  const char *error;
+  const char *buf = MapFileOrFail(file, size, &error);
+
+  if (error) {
+    fprintf(stderr, "%s \"%s\"!\n", error, file);
+  }
+  return buf;
+}
+
+/*
+* Release a mapping created by MapFile
+*/
+void UnmapFile(const char *buf, size_t size)
+{
+  if (buf) {
+    munmap((void*)buf, size);
+  }
+}
+
+/*
+* Decode the content of a text graph file that is already in memory.
+* The format is the same as the one accepted by ReadGraphFile, but the whole
+* buffer is decoded in a single pass, so neither a line buffer nor the
+* strtoul/strtol calls are needed. *file* is only used in error messages.
+*/
+void ParseGraphBuffer(graph_t *graph, const char *buf, size_t size, const char *file,
+                      int nvtxs, int nedges)
+{
+  int *xadj = graph->xadj;
+  int *adjncy = graph->adjncy;
+  unsigned *ste = graph->ste;
+  char *start = graph->start;
+  char *report = graph->report;
+  unsigned *nameoff = graph->nameoff;
+  const char *cur = buf;
+  const char *end = buf + size;
+  const char *word;
+  unsigned mask;
+  int edge, digit, negative;
+  int i, j, k;
+
+  graph->nvtxs = nvtxs;
+
+  for (xadj[0]=0, k=0, i=0; i<nvtxs; i++) {
+    /* Skip comment lines */
+    while (cur < end && *cur == '%') {
+      while (cur < end && *cur != '\n') {
+        cur++;
+      }
+      cur++;
+    }
+    if (cur >= end) {
+      errexit("Premature end of input file while reading vertex %d.\n", i+1);
+    }
+
+    /* Read NAME field */
+    for (word=cur; cur<end && *cur!=' '; cur++) {
+      if (*cur == '\n') {
+        break;
+      }
+    }
+    if (cur >= end || *cur != ' ') {
+      errexit("STE pattern is not complete at the %d line of file %s.\n", i, file);
+    }
+    if (graph->names) {
+      nameoff[i] = ArenaAdd(graph->names, word, cur - word);
+    }
+    cur++;
+
+    /* Read START and REPORT fields */
+    if (end - cur < 4) {
+      errexit("STE pattern is not complete at the %d line of file %s.\n", i, file);
+    }
+    start[i] = (cur[0] == '0')? 0: 1;
+    report[i] = (cur[2] == '0')? 0: 1;
+    cur += 4;
+
+    /* Read PATTERN field */
+    for (j=0; j<8; j++) {
+      cur = SkipBlank(cur, end);
+      mask = 0;
+      for (word=cur; cur<end && (digit = HexValue(*cur)) >= 0; cur++) {
+        mask = (mask << 4) | digit;
+      }
+      if (cur == word) {
+        errexit("STE pattern is not complete at the %d line of file %s.\n", i, file);
+      }
+      ste[i * 8 + j] = mask;
+    }
+
+    /* Read outgoing edges */
+    while (1) {
+      cur = SkipBlank(cur, end);
+      negative = 0;
+      word = cur;
+      if (cur < end && (*cur == '-' || *cur == '+')) {
+        negative = (*cur == '-');
+        cur++;
+      }
+      if (cur >= end || *cur < '0' || *cur > '9') {
+        cur = word;
+        break; /* End of line */
+      }
+      for (edge=0; cur<end && *cur>='0' && *cur<='9'; cur++) {
+        edge = edge * 10 + (*cur - '0');
+      }
+      if (negative) {
+        edge = -edge;
+      }
+
+      if (edge < 1 || edge > nvtxs)
+        errexit("Edge %d for vertex %d is out of bounds\n", edge, i+1);
+
+      if (k == nedges)
+        errexit("There are more edges in the file than the %d specified.\n", 
+            nedges);
+
+      adjncy[k] = edge-1;
+      k++;
+    }
+    xadj[i+1] = k;
+
+    /* Move to the next line */
+    while (cur < end && *cur != '\n') {
+      cur++;
+    }
+    cur++;
+  }
+
+  if (k != nedges) {
+    ReportEdgeMismatch(nedges, k);
+  }
+}
+
+/*
+* Read a graph file through a read-only memory mapping
+*/
+void MmapGraphFile(graph_t *graph, const char *file, int nvtxs, int nedges)
+{
+  size_t size;
+  const char *buf = MapFile(file, &size);
+
+  ParseGraphBuffer(graph, buf, size, file, nvtxs, nedges);
+  UnmapFile(buf, size);
+}
+
+/*
+* Copy a graph that is handed over in memory
+*/
+static void CopyGraphFromCC(graph_t *graph, const apmap_cc_t *cc)
+{
+  int nvtxs = cc->nstate;
+  int i;
+
+  graph->nvtxs = nvtxs;
+  memcpy(graph->xadj, cc->xadj, (nvtxs + 1) * sizeof(int));
+  memcpy(graph->adjncy, cc->adjncy, cc->nedge * sizeof(int));
+  memcpy(graph->ste, cc->ste, 8 * nvtxs * sizeof(unsigned));
+  memcpy(graph->start, cc->start, nvtxs);
+  memcpy(graph->report, cc->report, nvtxs);
+  if (graph->names) {
+    for (i=0; i<nvtxs; i++) {
+      graph->nameoff[i] = ArenaAdd(graph->names, cc->name[i], strlen(cc->name[i]));
+    }
+  }
+}
+
+/*
+* Read the graph of an automaton. Binary graph files are recognized by
+* their .apg extension; other files are handed to the given text parser.
+* Graphs that come from a bundled archive are decoded in place, and graphs
+* handed over by a library call are copied. If the graph has no name arena,
+* its states get consecutive numeric ids starting from automata->firstid.
+* The structural hash of the graph is computed as well.
+*/
+void LoadGraph(graph_t *graph, automata_t *automata, graphreader_t readtext)
+{
+  const char *fname = automata->fname;
+  size_t len = strlen(fname);
+  int i;
+
+  if (automata->cc) {
+    CopyGraphFromCC(graph, automata->cc);
+  }
+  else if (automata->data) {
+    if (automata->length >= 4 && memcmp(automata->data, APG_MAGIC, 4) == 0) {
+      ParseApgBuffer(graph, automata->data, automata->length, fname,
+                     automata->nstate, automata->nedge);
+    }
+    else {
+      ParseGraphBuffer(graph, automata->data, automata->length, fname,
+                       automata->nstate, automata->nedge);
+    }
+  }
+  else if (len > 4 && strcmp(fname + len - 4, ".apg") == 0) {
+    ReadApgFile(graph, fname, automata->nstate, automata->nedge);
+  }
+  else {
+    readtext(graph, fname, automata->nstate, automata->nedge);
+  }
+
+  if (!graph->names) {
+    for (i=0; i<automata->nstate; i++) {
+      graph->nameoff[i] = automata->firstid + i;
+    }
+  }
+  graph->shash = StructHash(graph);
+}
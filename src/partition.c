@@ -7,6 +7,9 @@
 */
 
 #include "apmapbin.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 /*
 * Decide the portion of parts according to the size of the remaining tile
@@ -39,14 +42,13 @@ void SetPartSize(float *tpwgts, int npart, int headsize, int tailsize)
 }
 
 /*
-* Calculate the total overhead caused by input/output constraints
+* The overhead of *npart* parts with *max_inout* ports each way
 */
-int CalcBoundaryOverhead(int *nin, int *nout, int npart, char has_g4)
+static GEOM_INLINE int SumOverhead(const int *nin, const int *nout, int npart, const int max_inout)
 {
   int in, out;
   int overhead = 0;
   int i;
-  int max_inout = has_g4? GLOBAL_NUM * 2 + 8: GLOBAL_NUM * 2;
 
   for (i=0; i<npart; i++) {
     in = (nin[i] + max_inout - 1) / max_inout;
@@ -58,6 +60,26 @@ int CalcBoundaryOverhead(int *nin, int *nout, int npart, char has_g4)
   return overhead;
 }
 
+/*
+* Calculate the total overhead caused by input/output constraints.
+* The refinement calls this for every move it tries, so the port counts
+* of the default geometry get copies of SumOverhead that divide by a
+* constant, i.e. shift.
+*/
+int CalcBoundaryOverhead(int *nin, int *nout, int npart, char has_g4)
+{
+  int max_inout = has_g4? GLOBAL_NUM * 2 + G4_WIDTH: GLOBAL_NUM * 2;
+
+  switch (max_inout) {
+    case DEF_GLOBAL_NUM * 2 + DEF_G4_WIDTH:
+      return SumOverhead(nin, nout, npart, DEF_GLOBAL_NUM * 2 + DEF_G4_WIDTH);
+    case DEF_GLOBAL_NUM * 2:
+      return SumOverhead(nin, nout, npart, DEF_GLOBAL_NUM * 2);
+    default:
+      return SumOverhead(nin, nout, npart, max_inout);
+  }
+}
+
 /*
 * Write partiton results to a file. Only used for debugging
 */
@@ -73,21 +95,186 @@ void WritePartitionToFile(const char* fname, int *part, int n)
 }
 
 /*
-* Call Metis for partitioning a graph.
-* Returns whether a partition satisfies the tile size constraint 
+* Check the part sizes of a partition.
+* Returns -1 if part 0 exceeds *headsize*, 0 if another part exceeds
+* TILE_SIZE and 1 if the partition satisfies the tile size constraint.
 */
-char MetisWrapper(graph_t *graph, float *tpwgts, int headsize, int *part)
+char CheckPartSize(const int *part, int nvtxs, int npart, int headsize)
 {
-  int options[METIS_NOPTIONS];
-  int npart = graph->npart;
-  int nvtxs = graph->nvtxs;
-  int ncon = 1;
-  int status, objval;
   int max = 0;
   int *size;
   char result;
   int i;
 
+  size = (int*)malloc(npart * sizeof(int));
+  for (i=0; i<npart; i++) {
+    size[i] = 0;
+  }
+  for (i=0; i<nvtxs; i++) {
+    size[part[i]]++;
+  }
+  for (i=0; i<npart; i++) {
+    max = (size[i]>max)? size[i]: max;
+  }
+
+  if (size[0] > headsize) {
+    result = -1;
+  }
+  else if (max > TILE_SIZE) {
+    result = 0;
+  }
+  else {
+    result = 1;
+  }
+  free(size);
+  return result;
+}
+
+/*
+* Build the vertex weights of the port balance constraint. Every state
+* weighs 1 for the tile size, and the # of its successors other than
+* itself for the ports, as a state with more successors is more likely to
+* be an out-state. Returns NULL if no state has such a successor.
+*/
+static int *PortWeights(graph_t *graph)
+{
+  int *vwgt = (int*)malloc(2 * graph->nvtxs * sizeof(int));
+  int total = 0;
+  int i, j;
+
+  for (i=0; i<graph->nvtxs; i++) {
+    vwgt[2*i] = 1;
+    vwgt[2*i+1] = 0;
+    for (j=graph->xadj[i]; j<graph->xadj[i+1]; j++) {
+      if (graph->adjncy[j] != i) {
+        vwgt[2*i+1]++;
+      }
+    }
+    total += vwgt[2*i+1];
+  }
+  if (total == 0) {
+    free(vwgt);
+    return NULL;
+  }
+  return vwgt;
+}
+
+/*
+* Metis 5 reseeds one process-wide random state at the start of every call
+* and then draws from it (GKlib uses srand/rand or a static state). Calls
+* that overlap in one process would draw from each other's stream. So while
+* threads that call Metis are running (npool > 0), every call runs in a
+* child process of its own, which has its own copy of that state. The
+* result of a call then only depends on its arguments, and the calls of
+* the threads really run at the same time.
+*/
+static pthread_mutex_t metislock = PTHREAD_MUTEX_INITIALIZER;
+static int npool = 0;
+
+/*
+* Tell MetisPartition that a pool of threads that may call Metis starts
+* (*on* is 1) or has ended (*on* is 0). Pools may be nested.
+*/
+void ParallelMetis(char on)
+{
+  pthread_mutex_lock(&metislock);
+  npool += on? 1: -1;
+  pthread_mutex_unlock(&metislock);
+}
+
+/*
+* Whether a pool of threads that may call Metis is running
+*/
+static char InParallel(void)
+{
+  char parallel;
+
+  pthread_mutex_lock(&metislock);
+  parallel = npool > 0;
+  pthread_mutex_unlock(&metislock);
+  return parallel;
+}
+
+/*
+* Read or write *size* bytes through a pipe. Returns 0 if it is closed early.
+*/
+static char PipeAll(int fd, void *buf, size_t size, char out)
+{
+  char *p = (char*)buf;
+  ssize_t n;
+
+  while (size > 0) {
+    n = out? write(fd, p, size): read(fd, p, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return 0;
+    }
+    p += n;
+    size -= n;
+  }
+  return 1;
+}
+
+/*
+* Run METIS_PartGraphKway in a child process. The child sends the status
+* and the partition of the *nvtxs* states back through a pipe.
+* Returns the status.
+*/
+static int ForkMetis(int nvtxs, int ncon, graph_t *graph, int *vwgt, int npart, float *tpwgts,
+                     int *options, int *part)
+{
+  int fd[2];
+  int status, objval;
+  pid_t pid;
+
+  if (pipe(fd) != 0) {
+    errexit("Cannot create a pipe for Metis!\n");
+  }
+  pid = fork();
+  if (pid < 0) {
+    errexit("Cannot start a Metis process!\n");
+  }
+  if (pid == 0) {
+    close(fd[0]);
+    status = METIS_PartGraphKway(&nvtxs, &ncon, graph->xadj, graph->adjncy, vwgt, NULL, NULL,
+                                 &npart, tpwgts, NULL, options, &objval, part);
+    if (PipeAll(fd[1], &status, sizeof(int), 1) && status == METIS_OK) {
+      PipeAll(fd[1], part, nvtxs * sizeof(int), 1);
+    }
+    _exit(0);
+  }
+
+  close(fd[1]);
+  if (!PipeAll(fd[0], &status, sizeof(int), 0) ||
+      (status == METIS_OK && !PipeAll(fd[0], part, nvtxs * sizeof(int), 0))) {
+    status = METIS_ERROR;
+  }
+  close(fd[0]);
+  waitpid(pid, NULL, 0);
+  return status;
+}
+
+/*
+* Call Metis for dividing a graph into *npart* parts.
+* With *vwgt* from PortWeights, Metis balances the port weights of the
+* parts as a second constraint, in the same proportions as their sizes.
+* A seed of -1 selects the fixed default seed of Metis.
+* Returns whether a partition satisfies the tile size constraint.
+* Only reads the graph, so it can be called from several threads at once
+* inside a pool announced by ParallelMetis.
+*/
+static char MetisPartition(graph_t *graph, int npart, float *tpwgts, int *vwgt, int headsize,
+                           int seed, int *part)
+{
+  int options[METIS_NOPTIONS];
+  int nvtxs = graph->nvtxs;
+  int ncon = vwgt? 2: 1;
+  float *cpwgts = NULL;
+  int status, objval;
+  int i;
+
   options[METIS_OPTION_PTYPE]   = METIS_PTYPE_KWAY;
   options[METIS_OPTION_OBJTYPE] = METIS_OBJTYPE_CUT;
   options[METIS_OPTION_CTYPE]   = METIS_CTYPE_SHEM;
@@ -97,7 +284,7 @@ char MetisWrapper(graph_t *graph, float *tpwgts, int headsize, int *part)
   options[METIS_OPTION_NSEPS] = 1;
   options[METIS_OPTION_NUMBERING] = 0;
   options[METIS_OPTION_NITER] = 10;
-  options[METIS_OPTION_SEED] = -1;
+  options[METIS_OPTION_SEED] = seed;
   options[METIS_OPTION_MINCONN] = 0;
   options[METIS_OPTION_NO2HOP]  = 0;
   options[METIS_OPTION_CONTIG]  = 0;
@@ -107,121 +294,648 @@ char MetisWrapper(graph_t *graph, float *tpwgts, int headsize, int *part)
   options[METIS_OPTION_UFACTOR] = -1;
   options[METIS_OPTION_DBGLVL]  = 0;
 
-  status = METIS_PartGraphKway(&nvtxs, &ncon, graph->xadj, 
-                   graph->adjncy, NULL, NULL, NULL, 
-                   &npart, tpwgts, NULL, options, 
-                   &objval, part);
+  if (vwgt && tpwgts) {
+    cpwgts = (float*)malloc(2 * npart * sizeof(float));
+    for (i=0; i<npart; i++) {
+      cpwgts[2*i] = cpwgts[2*i+1] = tpwgts[i];
+    }
+  }
+
+  if (InParallel()) {
+    status = ForkMetis(nvtxs, ncon, graph, vwgt, npart, vwgt? cpwgts: tpwgts, options, part);
+  }
+  else {
+    status = METIS_PartGraphKway(&nvtxs, &ncon, graph->xadj, 
+                     graph->adjncy, vwgt, NULL, NULL, 
+                     &npart, vwgt? cpwgts: tpwgts, NULL, options, 
+                     &objval, part);
+  }
+  free(cpwgts);
   if (status != METIS_OK) {
     errexit("Metis error: %d\n", status);
   }
   
-  /* Validate the partitioning results */
-  size = (int*)malloc(npart * sizeof(int));
+  return CheckPartSize(part, nvtxs, npart, headsize);
+}
+
+/*
+* Call Metis for partitioning a graph into graph->npart parts.
+* Returns whether a partition satisfies the tile size constraint 
+*/
+char MetisWrapper(graph_t *graph, float *tpwgts, int *vwgt, int headsize, int seed, int *part)
+{
+  return MetisPartition(graph, graph->npart, tpwgts, vwgt, headsize, seed, part);
+}
+
+/*
+* Refine a partition found by Metis on the port overhead. Part 0 may grow
+* up to *headsize* states and the middle parts up to TILE_SIZE, but the
+* last part may not grow, so no more tile space is used than Metis did.
+*/
+static void RefineMetisPartition(graph_t *ungraph, graph_t *graph, int npart, int headsize,
+                                 char has_g4, int *where)
+{
+  int *cap = (int*)malloc(npart * sizeof(int));
+  int i;
+
   for (i=0; i<npart; i++) {
-    size[i] = 0;
+    cap[i] = TILE_SIZE;
   }
-  for (i=0; i<nvtxs; i++) {
-    size[part[i]]++;
+  cap[npart-1] = 0;
+  for (i=0; i<graph->nvtxs; i++) {
+    if (where[i] == npart - 1) {
+      cap[npart-1]++;
+    }
   }
-  for (i=0; i<npart; i++) {
-    max = (size[i]>max)? size[i]: max;
+  cap[0] = (headsize < TILE_SIZE)? headsize: TILE_SIZE;
+  RefinePartition(ungraph, graph, npart, cap, has_g4, where);
+  free(cap);
+}
+
+/*
+* The seed of run *k* in a race of seeds from *seed* up.
+* The default seed -1 is followed by 1, 2, ...
+*/
+static int RaceSeed(int seed, int k)
+{
+  if (k == 0) {
+    return seed;
   }
+  return ((seed < 0)? 0: seed) + k;
+}
 
-  if (size[0] > headsize) {
-    result = -1;
+/*
+* Add a fallback choice: a candidate and the seed that partitioned it
+*/
+static void AddChoice(list_t *choice, int npart, int tailsize, int seed)
+{
+  ListAdd(choice, npart);
+  ListAdd(choice, tailsize);
+  ListAdd(choice, seed);
+}
+
+/*
+* Worker of a sweep. Evaluate the runs of the candidates of the batch one by one.
+*/
+static void *SweepWorker(void *arg)
+{
+  sweep_t *sweep = (sweep_t*)arg;
+  int *nin = (int*)malloc(TILE_NUM * sizeof(int));
+  int *nout = (int*)malloc(TILE_NUM * sizeof(int));
+  int *mark = (int*)malloc(TILE_NUM * sizeof(int));
+  float *tpwgts = (float*)malloc(TILE_NUM * sizeof(float));
+  parcand_t *cand;
+  seedrun_t *run;
+  int index;
+
+  while (1) {
+    pthread_mutex_lock(&sweep->lock);
+    index = sweep->next++;
+    pthread_mutex_unlock(&sweep->lock);
+    if (index >= sweep->ncand * sweep->nrun) {
+      break;
+    }
+
+    cand = &sweep->cand[index / sweep->nrun];
+    run = &cand->run[index % sweep->nrun];
+    SetPartSize(tpwgts, cand->npart, sweep->headsize, cand->tailsize);
+    if (sweep->partitioner == PARTITIONER_NATIVE) {
+      run->valid = NativePartition(sweep->ungraph, sweep->graph, cand->npart, sweep->headsize,
+                                   cand->tailsize, sweep->has_g4, run->where);
+    }
+    else {
+      run->valid = MetisPartition(sweep->ungraph, cand->npart, tpwgts, sweep->vwgt,
+                                  sweep->headsize, run->seed, run->where);
+    }
+    if (run->valid == 1) {
+      CountBoundary(sweep->graph, run->where, cand->npart, nin, nout, mark);
+      run->cost = CalcBoundaryOverhead(nin, nout, cand->npart, sweep->has_g4);
+    }
   }
-  else if (max > TILE_SIZE) {
-    result = 0;
+
+  free(nin);
+  free(nout);
+  free(mark);
+  free(tpwgts);
+  return NULL;
+}
+
+/*
+* Evaluate a batch of candidates with *nthreads* threads, the calling
+* thread included. Every run of a seed is a work item of its own, so the
+* seeds of a candidate are partitioned at the same time. With several
+* seeds, every candidate keeps its cheapest valid run; among equally good
+* runs the one of the first seed wins.
+*/
+static void RunSweep(sweep_t *sweep, int nthreads)
+{
+  int nwork = sweep->ncand * sweep->nrun;
+  pthread_t *thread;
+  parcand_t *cand;
+  seedrun_t *run;
+  int best;
+  int i, k;
+
+  for (i=0; i<sweep->ncand; i++) {
+    for (k=0; k<sweep->nrun; k++) {
+      sweep->cand[i].run[k].seed = RaceSeed(sweep->seed, k);
+    }
   }
-  else {
-    result = 1;
+  nthreads = (nthreads < nwork)? nthreads: nwork;
+  sweep->next = 0;
+  thread = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+  if (nthreads > 1) {
+    ParallelMetis(1);
   }
-  free(size);
-  return result;
+  for (i=1; i<nthreads; i++) {
+    if (pthread_create(&thread[i], NULL, SweepWorker, sweep) != 0) {
+      errexit("Cannot create partition thread %d!\n", i);
+    }
+  }
+  SweepWorker(sweep);
+  for (i=1; i<nthreads; i++) {
+    pthread_join(thread[i], NULL);
+  }
+  if (nthreads > 1) {
+    ParallelMetis(0);
+  }
+  free(thread);
+
+  for (i=0; i<sweep->ncand; i++) {
+    cand = &sweep->cand[i];
+    run = cand->run;
+    best = 0;
+    for (k=1; k<sweep->nrun; k++) {
+      if (run[k].valid == 1 && (run[best].valid != 1 || run[k].cost < run[best].cost)) {
+        best = k;
+      }
+    }
+    sweep->nwin += (best > 0);
+    cand->valid = run[best].valid;
+    cand->cost = run[best].cost;
+    cand->where = run[best].where;
+    cand->seed = run[best].seed;
+  }
+}
+
+/*
+* Evaluate the tail sizes tail[0..n-1] of *npart* parts, nbatch at a time,
+* and record the cost of each in row[tail - 1], or -1 if it is not valid,
+* and the seed that partitioned it in srow[tail - 1].
+* The partition of the cheapest candidate so far is kept in *minwhere*;
+* among equally cheap ones it is the first in the sweep order.
+*/
+static void EvalTails(sweep_t *sweep, int nbatch, int npart, const int *tail, int n, int *row,
+                      int *srow, int *minwhere, int *minpart, int *mintail, int *mincost, int *ncall)
+{
+  int nvtxs = sweep->graph->nvtxs;
+  parcand_t *cand;
+  int cost;
+  int i, k;
+
+  for (k=0; k<n; k+=nbatch) {
+    sweep->ncand = 0;
+    for (i=k; i<n && i<k+nbatch; i++) {
+      sweep->cand[sweep->ncand].npart = npart;
+      sweep->cand[sweep->ncand].tailsize = tail[i];
+      sweep->ncand++;
+    }
+    RunSweep(sweep, nbatch);
+    *ncall += sweep->ncand;
+
+    for (i=0; i<sweep->ncand; i++) {
+      cand = &sweep->cand[i];
+      if (cand->valid != 1) {
+        row[cand->tailsize - 1] = -1;
+        continue;
+      }
+      cost = cand->npart + cand->cost;
+      row[cand->tailsize - 1] = cost;
+      srow[cand->tailsize - 1] = cand->seed;
+      if (cost < *mincost ||
+          (cost == *mincost && (cand->npart < *minpart ||
+                                (cand->npart == *minpart && cand->tailsize < *mintail)))) {
+        *mincost = cost;
+        *minpart = cand->npart;
+        *mintail = cand->tailsize;
+        memcpy(minwhere, cand->where, nvtxs * sizeof(int));
+      }
+    }
+  }
+}
+
+/*
+* Whether the tail sizes between two evaluated ones, of costs *a* and *b*
+* (-1 if not valid), may hold the cheapest candidate. The cost is taken to
+* change linearly between samples, so a gap between equal costs is flat and
+* skipped; of the others only the gaps next to the cheapest samples and
+* the points where partitions become valid are searched.
+*/
+static char Promising(int a, int b, int mincost)
+{
+  return a != b &&
+         ((a >= 0 && a <= mincost) || (b >= 0 && b <= mincost) || ((a < 0) != (b < 0)));
 }
 
 /*
-* Partition a given graph
+* Search the (npart, tailsize) candidates that follow (npart, tailsize)
+* without trying all of them. For every # of parts the tail sizes are
+* sampled every TAIL_STRIDE, and only the gaps next to promising samples
+* are filled in. The list of fallback choices is built as the exhaustive
+* sweep would build it from the candidates that were tried.
+* Returns 0 if no valid partition was found.
 */
-char PartitionGraph(graph_t *ungraph, graph_t *graph, int headsize, list_t *choice, int has_g4, int no_opt)
+static char GuidedSweep(sweep_t *sweep, int nbatch, int npart, int tailsize, list_t *choice,
+                        int *minwhere, int *minpart, int *mincost, mapopt_t *opt)
+{
+  int *tried, *row, *seeds, *srow;
+  int *tail = (int*)malloc(TILE_SIZE * sizeof(int));
+  int npart0, tail0, nrow;
+  int mintail = 0, ncall = 0, nexh;
+  int lo, prev, n;
+  int best, bestpart, besttail, bestseed;
+  int p, t, u;
+
+  /* The first candidate */
+  tail0 = tailsize + 1;
+  npart0 = npart;
+  if (tail0 > TILE_SIZE) {
+    tail0 -= TILE_SIZE;
+    npart0++;
+  }
+  nrow = TILE_NUM - npart0 + 1;
+  if (nrow <= 0) {
+    free(tail);
+    return 0;
+  }
+  tried = (int*)malloc(nrow * TILE_SIZE * sizeof(int));
+  seeds = (int*)malloc(nrow * TILE_SIZE * sizeof(int));
+  for (t=0; t<nrow*TILE_SIZE; t++) {
+    tried[t] = -2;
+  }
+
+  *mincost = TILE_NUM + 1;
+  *minpart = TILE_NUM;
+  for (p=npart0; p<=TILE_NUM && p<=*mincost; p++) {
+    row = tried + (p - npart0) * TILE_SIZE;
+    srow = seeds + (p - npart0) * TILE_SIZE;
+    lo = (p == npart0)? tail0: 1;
+
+    /* Coarse samples */
+    n = 0;
+    for (t=lo; t<TILE_SIZE; t+=TAIL_STRIDE) {
+      tail[n++] = t;
+    }
+    tail[n++] = TILE_SIZE;
+    EvalTails(sweep, nbatch, p, tail, n, row, srow, minwhere, minpart, &mintail, mincost, &ncall);
+
+    /* Fill in the gaps next to promising samples until none is left */
+    do {
+      n = 0;
+      prev = lo;
+      for (t=lo+1; t<=TILE_SIZE; t++) {
+        if (row[t-1] == -2) {
+          continue;
+        }
+        if (t - prev > 1 && Promising(row[prev-1], row[t-1], *mincost)) {
+          for (u=prev+1; u<t; u++) {
+            tail[n++] = u;
+          }
+        }
+        prev = t;
+      }
+      EvalTails(sweep, nbatch, p, tail, n, row, srow, minwhere, minpart, &mintail, mincost, &ncall);
+    } while (n > 0);
+  }
+
+  if (*minpart == TILE_NUM && *mincost == TILE_NUM + 1) {
+    free(tried);
+    free(seeds);
+    free(tail);
+    return 0;
+  }
+
+  /* Replay the tried candidates in the sweep order for the fallback choices */
+  EmptyList(choice);
+  best = TILE_NUM + 1;
+  bestpart = TILE_NUM;
+  besttail = 0;
+  bestseed = 0;
+  for (p=npart0; p<=TILE_NUM && p<=best; p++) {
+    row = tried + (p - npart0) * TILE_SIZE;
+    srow = seeds + (p - npart0) * TILE_SIZE;
+    for (t=1; t<=TILE_SIZE; t++) {
+      if (row[t-1] < 0) {
+        continue;
+      }
+      if (row[t-1] < best) {
+        if (bestpart < TILE_NUM) {
+          AddChoice(choice, bestpart, besttail, bestseed);
+        }
+        best = row[t-1];
+        bestpart = p;
+        besttail = t;
+        bestseed = srow[t-1];
+      }
+      else if (row[t-1] == best) {
+        AddChoice(choice, p, t, srow[t-1]);
+      }
+    }
+  }
+
+  /* Count the candidates the exhaustive sweep would have tried */
+  nexh = 0;
+  p = npart0;
+  t = tail0;
+  while (p <= TILE_NUM) {
+    nexh++;
+    if (p > *mincost) {
+      break;
+    }
+    if (++t > TILE_SIZE) {
+      t = 1;
+      p++;
+    }
+  }
+  opt->ncall += ncall;
+  opt->nsaved += (nexh > ncall)? nexh - ncall: 0;
+
+  free(tried);
+  free(seeds);
+  free(tail);
+  return 1;
+}
+
+/*
+* Partition a given graph.
+* The (npart, tailsize) candidates are tried in a fixed order until no
+* cheaper partition is possible. They are evaluated speculatively in batches
+* of opt->partthreads candidates, one per thread, and the results are then
+* walked through in order. Candidates behind the point where the order stops
+* are dropped, so the chosen partition and the list of fallback choices are
+* the same for any # of threads. With opt->nseed seeds, every candidate is
+* partitioned once per seed and the cheapest run counts; the fallback
+* choices record its seed, so that RePartitionGraph gets the same partition.
+* Unless opt->exhaustive or opt->no_opt is set, the candidates are searched
+* by GuidedSweep instead, which tries a fraction of them. It falls back to
+* the exhaustive sweep if it finds no valid partition.
+* With a partition cache, a graph that was partitioned before is restored
+* from the cache without calling Metis. So is a graph with the same
+* structure as one partitioned earlier in this run, or partitioned ahead
+* by PartitionAhead.
+* An acyclic graph is first cut in topological order (ShapePartition);
+* if that needs no extra ports, it is optimal and no sweep is needed.
+* graph->shaped tells whether the partition is such a cut.
+*/
+char PartitionGraph(graph_t *ungraph, graph_t *graph, int headsize, list_t *choice, int has_g4,
+                    mapopt_t *opt)
 {
   int nvtxs = graph->nvtxs;
+  int nbatch = (opt->partthreads > 0)? opt->partthreads: 1;
   int *nin = (int*)malloc(TILE_NUM * sizeof(int));
   int *nout = (int*)malloc(TILE_NUM * sizeof(int));
-  float *tpwgts = (float*)malloc(TILE_NUM * sizeof(float));
-  int cost, initcost, mincost, minpart, tailsize, mintail;
+  int *minwhere = (int*)malloc(nvtxs * sizeof(int));
+  int cost, mincost, minpart, tailsize, mintail;
+  int npart, lastpart, lasttail, validpart;
+  int minseed, lastseed;
+  int *lastwhere = NULL;
+  unsigned long long key[2];
+  char more = 1;
+  char optimal, refine;
   int valid = 0;
+  sweep_t sweep;
+  int i, k;
+
+  graph->shaped = 0;
+  if (opt->classes && LookupClass(opt->classes, graph, ungraph, headsize, choice)) {
+    free(nin);
+    free(nout);
+    free(minwhere);
+    return 1;
+  }
+  if (opt->aheadtab && LookupClass(opt->aheadtab, graph, ungraph, headsize, choice)) {
+    if (opt->classes) {
+      AddClass(opt->classes, graph, ungraph, headsize, choice);
+    }
+    free(nin);
+    free(nout);
+    free(minwhere);
+    return 1;
+  }
+  if (opt->fastpath && ShapePartition(graph, headsize, has_g4, &npart)) {
+    EmptyList(choice);
+    ungraph->npart = graph->npart = npart;
+    graph->cost = npart;
+    graph->shaped = 1;
+    CountBoundaryNodes(graph, nin, nout);
+    opt->nfast++;
+    if (opt->classes) {
+      AddClass(opt->classes, graph, ungraph, headsize, choice);
+    }
+    free(nin);
+    free(nout);
+    free(minwhere);
+    return 1;
+  }
+  if (opt->cachedir) {
+    PartitionKey(graph, headsize, has_g4, opt, key);
+    if (LoadPartition(opt->cachedir, key, graph, ungraph, choice)) {
+      opt->cachehit++;
+      if (opt->classes) {
+        AddClass(opt->classes, graph, ungraph, headsize, choice);
+      }
+      free(nin);
+      free(nout);
+      free(minwhere);
+      return 1;
+    }
+    opt->cachemiss++;
+  }
+
+  sweep.ungraph = ungraph;
+  sweep.graph = graph;
+  sweep.headsize = headsize;
+  sweep.has_g4 = has_g4;
+  sweep.seed = opt->seed;
+  sweep.nrun = (opt->partitioner == PARTITIONER_METIS)? opt->nseed: 1;
+  sweep.nwin = 0;
+  sweep.partitioner = opt->partitioner;
+  sweep.vwgt = (opt->portbal && opt->partitioner == PARTITIONER_METIS)? PortWeights(graph): NULL;
+  sweep.cand = (parcand_t*)malloc(nbatch * sizeof(parcand_t));
+  for (i=0; i<nbatch; i++) {
+    sweep.cand[i].run = (seedrun_t*)malloc(sweep.nrun * sizeof(seedrun_t));
+    for (k=0; k<sweep.nrun; k++) {
+      sweep.cand[i].run[k].where = (int*)malloc(nvtxs * sizeof(int));
+    }
+  }
+  pthread_mutex_init(&sweep.lock, NULL);
 
   EmptyList(choice);
-  ungraph->npart = (nvtxs - headsize - 1) / TILE_SIZE + 2;
+  npart = (nvtxs - headsize - 1) / TILE_SIZE + 2;
   tailsize = (nvtxs - headsize - 1) % TILE_SIZE;
+  lastpart = validpart = npart;
+  lasttail = tailsize;
   mincost = TILE_NUM + 1;
-  while (ungraph->npart <= mincost && (!no_opt || valid != 1)) {
-    /* Increase the tailsize in each try */
-    tailsize += 1;
-    if (tailsize > TILE_SIZE) {
-      tailsize -= TILE_SIZE;
-      ungraph->npart++;
-      if (ungraph->npart > TILE_NUM) {
-        errexit("Cannot partition graph with %d states\n", nvtxs);
+  minpart = TILE_NUM;
+  mintail = 0;
+  minseed = lastseed = opt->seed;
+  if (!opt->exhaustive && !opt->no_opt &&
+      GuidedSweep(&sweep, nbatch, npart, tailsize, choice, minwhere, &minpart, &mincost, opt)) {
+    more = 0;
+    lastpart = 0; /* Take the best candidate below */
+  }
+  while (more) {
+    /* Stop before trying the next candidate, as the serial sweep would */
+    if (lastpart > mincost || (opt->no_opt && valid == 1)) {
+      break;
+    }
+
+    /* Generate the next batch; the tailsize increases in each try */
+    sweep.ncand = 0;
+    while (sweep.ncand < nbatch) {
+      tailsize += 1;
+      if (tailsize > TILE_SIZE) {
+        tailsize -= TILE_SIZE;
+        npart++;
       }
+      if (npart > TILE_NUM) {
+        break;
+      }
+      sweep.cand[sweep.ncand].npart = npart;
+      sweep.cand[sweep.ncand].tailsize = tailsize;
+      sweep.ncand++;
     }
+    RunSweep(&sweep, nbatch);
+    opt->ncall += sweep.ncand;
 
-    SetPartSize(tpwgts, ungraph->npart, headsize, tailsize);
-    valid = MetisWrapper(ungraph, tpwgts, headsize, graph->where);
-    if (valid == 1) {
-      graph->cost = graph->npart = ungraph->npart;
-      CountBoundaryNodes(graph, nin, nout);
-      cost = CalcBoundaryOverhead(nin, nout, ungraph->npart, has_g4);
-      valid = cost + 1;
-      if (!no_opt && ungraph->npart + cost < mincost) {
-        if (minpart < TILE_NUM) {
-          ListAdd(choice, minpart);
-          ListAdd(choice, mintail);
-        }
-        minpart = ungraph->npart;
-        mincost = minpart + cost;
-        mintail = tailsize;
+    /* Walk through the results in order */
+    for (i=0; i<sweep.ncand; i++) {
+      if (i > 0 && (lastpart > mincost || (opt->no_opt && valid == 1))) {
+        more = 0;
+        break;
       }
-      else if (ungraph->npart+cost == mincost) {
-        ListAdd(choice, ungraph->npart);
-        ListAdd(choice, tailsize);
+      lastpart = sweep.cand[i].npart;
+      lasttail = sweep.cand[i].tailsize;
+      lastwhere = sweep.cand[i].where;
+      lastseed = sweep.cand[i].seed;
+      valid = sweep.cand[i].valid;
+      if (valid == 1) {
+        validpart = lastpart;
+        cost = sweep.cand[i].cost;
+        valid = cost + 1;
+        if (!opt->no_opt && lastpart + cost < mincost) {
+          if (minpart < TILE_NUM) {
+            AddChoice(choice, minpart, mintail, minseed);
+          }
+          minpart = lastpart;
+          mincost = minpart + cost;
+          mintail = lasttail;
+          minseed = lastseed;
+          memcpy(minwhere, lastwhere, nvtxs * sizeof(int));
+        }
+        else if (lastpart + cost == mincost) {
+          AddChoice(choice, lastpart, lasttail, lastseed);
+        }
       }
     }
+    if (more && sweep.ncand < nbatch &&
+        lastpart <= mincost && (!opt->no_opt || valid != 1)) {
+      errexit("Cannot partition graph with %d states\n", nvtxs);
+    }
   }
 
-  /* Make sure the result is optimal */
-  if (!no_opt && (ungraph->npart!=minpart || tailsize!=mintail)) {
-    SetPartSize(tpwgts, minpart, headsize, mintail);
+  /* Make sure the result is optimal. Both partitioners are deterministic, so
+     the partition kept for the best candidate is what a new call would give. */
+  optimal = !opt->no_opt && (lastpart!=minpart || lasttail!=mintail);
+  if (optimal) {
+    memcpy(graph->where, minwhere, nvtxs * sizeof(int));
     ungraph->npart = minpart;
-    MetisWrapper(ungraph, tpwgts, headsize, graph->where);
     graph->npart = minpart;
     graph->cost = mincost;
-    CountBoundaryNodes(graph, nin, nout);
   }
+  else {
+    memcpy(graph->where, lastwhere, nvtxs * sizeof(int));
+    ungraph->npart = lastpart;
+    graph->cost = graph->npart = validpart;
+  }
+
+  /* Only the chosen partition is refined, as RePartitionGraph refines a fallback.
+     The refinement never raises the port overhead, so the cost can only drop. */
+  refine = opt->partitioner == PARTITIONER_METIS && opt->refine;
+  if (refine) {
+    RefineMetisPartition(ungraph, graph, ungraph->npart, headsize, has_g4, graph->where);
+  }
+  CountBoundaryNodes(graph, nin, nout);
+  if (refine && optimal) {
+    graph->cost = CalcBoundaryOverhead(nin, nout, graph->npart, has_g4) + graph->npart;
+  }
+  if (opt->cachedir) {
+    StorePartition(opt->cachedir, key, graph, ungraph, choice);
+  }
+  if (opt->classes) {
+    AddClass(opt->classes, graph, ungraph, headsize, choice);
+  }
+
+  opt->nwin += sweep.nwin;
+  pthread_mutex_destroy(&sweep.lock);
+  for (i=0; i<nbatch; i++) {
+    for (k=0; k<sweep.nrun; k++) {
+      free(sweep.cand[i].run[k].where);
+    }
+    free(sweep.cand[i].run);
+  }
+  free(sweep.cand);
+  free(sweep.vwgt);
+  free(minwhere);
   free(nin);
   free(nout);
-  free(tpwgts);
   return 1;
 }
 
 /*
-* Partition a graph using given parameters
+* Partition a graph using the parameters of the last fallback choice.
+* A choice of the native partitioner that it cannot make again is made by
+* Metis instead; it is an error if neither gives a valid partition.
 */
-void RePartitionGraph(graph_t *ungraph, graph_t *graph, list_t *choice, char has_g4)
+void RePartitionGraph(graph_t *ungraph, graph_t *graph, list_t *choice, char has_g4,
+                      mapopt_t *opt)
 {
+  int seed = ListPop(choice);
   int tail = ListPop(choice);
   int npart = ListPop(choice);
   float *tpwgts = NULL;
+  int *vwgt = NULL;
   int *nin = (int*)malloc(TILE_NUM * sizeof(int));
   int *nout = (int*)malloc(TILE_NUM * sizeof(int));
+  char valid = 0;
 
   ungraph->npart = npart;
   if (tail < TILE_SIZE) {
     tpwgts = (float*)malloc(npart * sizeof(float));
     SetPartSizeTarget(tpwgts, npart, tail);
   }
-  assert(MetisWrapper(ungraph, tpwgts, TILE_SIZE, graph->where));
+  if (opt->partitioner == PARTITIONER_NATIVE) {
+    valid = NativePartition(ungraph, graph, npart, TILE_SIZE, (tail < TILE_SIZE)? tail: TILE_SIZE,
+                            has_g4, graph->where);
+  }
+  /* Metis partitions the graph if the native partitioner does not repeat its choice */
+  if (valid != 1) {
+    if (opt->portbal) {
+      vwgt = PortWeights(graph);
+    }
+    valid = MetisWrapper(ungraph, tpwgts, vwgt, TILE_SIZE, seed, graph->where);
+    if (valid != 1 && vwgt) {
+      /* The port balance is only a preference */
+      valid = MetisWrapper(ungraph, tpwgts, NULL, TILE_SIZE, seed, graph->where);
+    }
+    if (valid != 1) {
+      errexit("Cannot partition a graph of %d states into %d parts again!\n", graph->nvtxs, npart);
+    }
+    free(vwgt);
+    if (opt->refine) {
+      RefineMetisPartition(ungraph, graph, npart, TILE_SIZE, has_g4, graph->where);
+    }
+  }
   CountBoundaryNodes(graph, nin, nout);
   graph->npart = ungraph->npart;
   graph->cost = CalcBoundaryOverhead(nin, nout, ungraph->npart, has_g4) + graph->npart;
@@ -0,0 +1,196 @@
+/*
+* Copyright (c) 2019, Delft University of Technology
+*
+* prefetch.c
+*
+* Functions related to parsing upcoming graphs in the background
+*/
+#include "apmapbin.h"
+
+/*
+* Allocate a graph struct that only holds the fields filled by a parser
+*/
+static graph_t *CreateSlotGraph(int nvtxs, int nedges, arena_t *names)
+{
+  graph_t *graph = (graph_t *)malloc(sizeof(graph_t));
+
+  memset((void *)graph, 0, sizeof(graph_t));
+  graph->xadj   = (int*)malloc((nvtxs+1) * sizeof(int));
+  graph->adjncy = (int*)malloc(nedges * sizeof(int));
+  graph->ste    = (unsigned*)malloc(8 * nvtxs * sizeof(unsigned));
+  graph->start  = (char*)malloc(nvtxs);
+  graph->report = (char*)malloc(nvtxs);
+  graph->names  = names;
+  graph->nameoff = (unsigned*)malloc(nvtxs * sizeof(unsigned));
+  return graph;
+}
+
+/*
+* Exchange the parsed fields of two graphs of the same capacity
+*/
+static void SwapParsedFields(graph_t *a, graph_t *b)
+{
+  graph_t tmp = *a;
+
+  a->nvtxs = b->nvtxs;
+  a->xadj = b->xadj;
+  a->adjncy = b->adjncy;
+  a->ste = b->ste;
+  a->start = b->start;
+  a->report = b->report;
+  a->nameoff = b->nameoff;
+  a->shash = b->shash;
+
+  b->nvtxs = tmp.nvtxs;
+  b->xadj = tmp.xadj;
+  b->adjncy = tmp.adjncy;
+  b->ste = tmp.ste;
+  b->start = tmp.start;
+  b->report = tmp.report;
+  b->nameoff = tmp.nameoff;
+  b->shash = tmp.shash;
+}
+
+/*
+* Worker thread. Parse the automata in sorted order into free slots,
+* skipping the ones that have already been taken by the mapper.
+*/
+static void *PrefetchWorker(void *arg)
+{
+  prefetch_t *pf = (prefetch_t*)arg;
+  int slot, index;
+
+  pthread_mutex_lock(&pf->lock);
+  while (1) {
+    while (pf->next < pf->ngraph && pf->taken[pf->next]) {
+      pf->next++;
+    }
+    if (pf->stop || pf->next >= pf->ngraph) {
+      break;
+    }
+    for (slot=0; slot<pf->depth; slot++) {
+      if (pf->index[slot] == -1) {
+        break;
+      }
+    }
+    if (slot == pf->depth) {
+      pthread_cond_wait(&pf->cond, &pf->lock);
+      continue;
+    }
+
+    index = pf->next++;
+    pf->index[slot] = index;
+    pf->ready[slot] = 0;
+    pthread_mutex_unlock(&pf->lock);
+
+    LoadGraph(pf->slot[slot], &pf->automata[index], pf->readtext);
+
+    pthread_mutex_lock(&pf->lock);
+    pf->ready[slot] = 1;
+    pthread_cond_broadcast(&pf->cond);
+  }
+  pthread_mutex_unlock(&pf->lock);
+  return NULL;
+}
+
+/*
+* Create a prefetch stage with *depth* graph buffers and *nthreads* parsers.
+* The automata must already be sorted in the order they will be mapped.
+* With depth 0 every graph is parsed on demand by the calling thread.
+*/
+prefetch_t *CreatePrefetch(automata_t *automata, int ngraph, graphreader_t readtext,
+                           int depth, int nthreads, int nvtxs, int nedges, arena_t *names)
+{
+  prefetch_t *pf = (prefetch_t*)malloc(sizeof(prefetch_t));
+  int i;
+
+  if (depth <= 0 || nthreads <= 0) {
+    depth = 0;
+    nthreads = 0;
+  }
+  pf->automata = automata;
+  pf->ngraph = ngraph;
+  pf->readtext = readtext;
+  pf->depth = depth;
+  pf->nthreads = nthreads;
+  pf->next = 0;
+  pf->stop = 0;
+  pf->taken = (char*)calloc(ngraph, 1);
+  pf->slot = (graph_t**)malloc(depth * sizeof(graph_t*));
+  pf->index = (int*)malloc(depth * sizeof(int));
+  pf->ready = (char*)malloc(depth);
+  for (i=0; i<depth; i++) {
+    pf->slot[i] = CreateSlotGraph(nvtxs, nedges, names);
+    pf->index[i] = -1;
+    pf->ready[i] = 0;
+  }
+
+  pthread_mutex_init(&pf->lock, NULL);
+  pthread_cond_init(&pf->cond, NULL);
+  pf->thread = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+  for (i=0; i<nthreads; i++) {
+    if (pthread_create(&pf->thread[i], NULL, PrefetchWorker, pf) != 0) {
+      errexit("Cannot create prefetch thread %d!\n", i);
+    }
+  }
+  return pf;
+}
+
+/*
+* Fill *graph* with the automaton at *index*.
+* A prefetched graph is handed over without copying; otherwise it is parsed now.
+*/
+void PrefetchGraph(prefetch_t *pf, int index, graph_t *graph)
+{
+  int slot;
+
+  pthread_mutex_lock(&pf->lock);
+  pf->taken[index] = 1;
+  for (slot=0; slot<pf->depth; slot++) {
+    if (pf->index[slot] == index) {
+      break;
+    }
+  }
+  if (slot == pf->depth) {
+    pthread_mutex_unlock(&pf->lock);
+    LoadGraph(graph, &pf->automata[index], pf->readtext);
+    return;
+  }
+
+  while (!pf->ready[slot]) {
+    pthread_cond_wait(&pf->cond, &pf->lock);
+  }
+  SwapParsedFields(graph, pf->slot[slot]);
+  pf->index[slot] = -1;
+  pf->ready[slot] = 0;
+  pthread_cond_broadcast(&pf->cond);
+  pthread_mutex_unlock(&pf->lock);
+}
+
+/*
+* Stop the workers and release the prefetch stage
+*/
+void FreePrefetch(prefetch_t *pf)
+{
+  int i;
+
+  pthread_mutex_lock(&pf->lock);
+  pf->stop = 1;
+  pthread_cond_broadcast(&pf->cond);
+  pthread_mutex_unlock(&pf->lock);
+  for (i=0; i<pf->nthreads; i++) {
+    pthread_join(pf->thread[i], NULL);
+  }
+
+  for (i=0; i<pf->depth; i++) {
+    FreeGraph(&pf->slot[i], 0);
+  }
+  pthread_mutex_destroy(&pf->lock);
+  pthread_cond_destroy(&pf->cond);
+  free(pf->thread);
+  free(pf->slot);
+  free(pf->index);
+  free(pf->ready);
+  free(pf->taken);
+  free(pf);
+}
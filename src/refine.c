@@ -0,0 +1,379 @@
+/*
+* Copyright (c) 2019, Delft University of Technology
+*
+* refine.c
+*
+* Fiduccia-Mattheyses style refinement of a partition on the overhead of
+* the tile ports, i.e. the boundary nodes counted by CountBoundaryNodes
+*/
+#include "apmapbin.h"
+
+/* A pass stops after this many moves that do not lower the cost */
+#define FM_STALL 64
+
+/* The largest # of passes */
+#define FM_NPASS 8
+
+/*
+* The share of part *q* in the cost
+*/
+static long long PartCost(portref_t *r, int q)
+{
+  return CalcBoundaryOverhead(&r->nin[q], &r->nout[q], 1, r->has_g4) * r->scale
+         + r->nin[q] + r->nout[q];
+}
+
+/*
+* Add (sign 1) or remove (sign -1) the boundary nodes caused by state *u*
+* and update the cost
+*/
+static void AddPortUse(portref_t *r, int u, int sign)
+{
+  graph_t *graph = r->graph;
+  int own = r->where[u];
+  char external = 0;
+  int q, j;
+
+  r->tick++;
+  for (j=graph->xadj[u]; j<graph->xadj[u+1]; j++) {
+    q = r->where[graph->adjncy[j]];
+    if (q != own && r->stamp[q] != r->tick) {
+      r->stamp[q] = r->tick;
+      r->cost -= PartCost(r, q);
+      r->nin[q] += sign;
+      r->cost += PartCost(r, q);
+      external = 1;
+    }
+  }
+  if (external) {
+    r->cost -= PartCost(r, own);
+    r->nout[own] += sign;
+    r->cost += PartCost(r, own);
+  }
+}
+
+/*
+* Collect state *v* and its predecessors, i.e. the states whose boundary
+* nodes depend on the part of v, in r->aff. Returns their #.
+*/
+static int CollectAffected(portref_t *r, int v)
+{
+  int naff = 1;
+  int u, j;
+
+  r->vtick++;
+  r->vstamp[v] = r->vtick;
+  r->aff[0] = v;
+  for (j=r->rxadj[v]; j<r->rxadj[v+1]; j++) {
+    u = r->radjncy[j];
+    if (r->vstamp[u] != r->vtick) {
+      r->vstamp[u] = r->vtick;
+      r->aff[naff++] = u;
+    }
+  }
+  return naff;
+}
+
+/*
+* Find the best part to move state *v* to, among the parts of its
+* neighbors that have room. The last state of a part stays, so no part
+* becomes empty. Returns -1 if there is none; otherwise *gain* is set to
+* the drop of the cost, which may be negative.
+*/
+static int BestMove(portref_t *r, int v, long long *gain)
+{
+  graph_t *ungraph = r->ungraph;
+  int a = r->where[v];
+  long long start = r->cost;
+  long long bestcost = 0;
+  int ncand = 0;
+  int best = -1;
+  int naff, b;
+  int i, j;
+
+  if (r->size[a] == 1) {
+    return -1;
+  }
+  r->ptick++;
+  r->pstamp[a] = r->ptick;
+  for (j=ungraph->xadj[v]; j<ungraph->xadj[v+1]; j++) {
+    b = r->where[ungraph->adjncy[j]];
+    if (r->pstamp[b] != r->ptick) {
+      r->pstamp[b] = r->ptick;
+      if (r->size[b] < r->cap[b]) {
+        r->cand[ncand++] = b;
+      }
+    }
+  }
+  if (ncand == 0) {
+    return -1;
+  }
+
+  naff = CollectAffected(r, v);
+  for (i=0; i<naff; i++) {
+    AddPortUse(r, r->aff[i], -1);
+  }
+  for (j=0; j<ncand; j++) {
+    r->where[v] = r->cand[j];
+    for (i=0; i<naff; i++) {
+      AddPortUse(r, r->aff[i], 1);
+    }
+    if (best == -1 || r->cost < bestcost) {
+      best = r->cand[j];
+      bestcost = r->cost;
+    }
+    for (i=0; i<naff; i++) {
+      AddPortUse(r, r->aff[i], -1);
+    }
+  }
+  r->where[v] = a;
+  for (i=0; i<naff; i++) {
+    AddPortUse(r, r->aff[i], 1);
+  }
+
+  *gain = start - bestcost;
+  return best;
+}
+
+/*
+* Move state *v* to part *b*
+*/
+static void MoveState(portref_t *r, int v, int b)
+{
+  int naff = CollectAffected(r, v);
+  int i;
+
+  for (i=0; i<naff; i++) {
+    AddPortUse(r, r->aff[i], -1);
+  }
+  r->size[r->where[v]]--;
+  r->where[v] = b;
+  r->size[b]++;
+  for (i=0; i<naff; i++) {
+    AddPortUse(r, r->aff[i], 1);
+  }
+}
+
+/*
+* Push the move of state *v* into the heap. Older moves of v become stale.
+*/
+static void PushMove(portref_t *r, int v, long long gain)
+{
+  fmmove_t move;
+  int i, parent;
+
+  if (r->nheap == r->maxheap) {
+    r->maxheap *= 2;
+    r->heap = (fmmove_t*)realloc(r->heap, r->maxheap * sizeof(fmmove_t));
+  }
+  move.gain = gain;
+  move.vtx = v;
+  move.ver = ++r->ver[v];
+
+  i = r->nheap++;
+  while (i > 0) {
+    parent = (i - 1) / 2;
+    if (r->heap[parent].gain >= gain) {
+      break;
+    }
+    r->heap[i] = r->heap[parent];
+    i = parent;
+  }
+  r->heap[i] = move;
+}
+
+/*
+* Pop the move with the largest gain from the heap
+*/
+static fmmove_t PopMove(portref_t *r)
+{
+  fmmove_t top = r->heap[0];
+  fmmove_t last = r->heap[--r->nheap];
+  int i = 0, child;
+
+  while ((child = 2 * i + 1) < r->nheap) {
+    if (child + 1 < r->nheap && r->heap[child+1].gain > r->heap[child].gain) {
+      child++;
+    }
+    if (last.gain >= r->heap[child].gain) {
+      break;
+    }
+    r->heap[i] = r->heap[child];
+    i = child;
+  }
+  if (r->nheap > 0) {
+    r->heap[i] = last;
+  }
+  return top;
+}
+
+/*
+* One pass: move the state with the largest gain, even if the cost rises,
+* lock it and repeat, then roll back to the cheapest point of the pass.
+* Gains are recomputed when a move is popped, as a move elsewhere may
+* have changed them. Returns whether the cost dropped.
+*/
+static char RefinePass(portref_t *r, int *log, int *from)
+{
+  int nvtxs = r->graph->nvtxs;
+  graph_t *ungraph = r->ungraph;
+  long long start = r->cost;
+  long long mincost = r->cost;
+  long long gain;
+  int nlog = 0, minlog = 0;
+  fmmove_t move;
+  int b, u, v, j;
+
+  r->nheap = 0;
+  for (v=0; v<nvtxs; v++) {
+    r->locked[v] = 0;
+    if (BestMove(r, v, &gain) != -1) {
+      PushMove(r, v, gain);
+    }
+  }
+
+  while (r->nheap > 0 && nlog - minlog < FM_STALL) {
+    move = PopMove(r);
+    v = move.vtx;
+    if (r->locked[v] || move.ver != r->ver[v]) {
+      continue;
+    }
+    b = BestMove(r, v, &gain);
+    if (b == -1) {
+      continue;
+    }
+    if (gain != move.gain) {
+      PushMove(r, v, gain);
+      continue;
+    }
+
+    log[nlog] = v;
+    from[nlog] = r->where[v];
+    nlog++;
+    MoveState(r, v, b);
+    r->locked[v] = 1;
+    if (r->cost < mincost) {
+      mincost = r->cost;
+      minlog = nlog;
+    }
+
+    /* The neighbors may have a new target part */
+    for (j=ungraph->xadj[v]; j<ungraph->xadj[v+1]; j++) {
+      u = ungraph->adjncy[j];
+      if (!r->locked[u]) {
+        if (BestMove(r, u, &gain) != -1) {
+          PushMove(r, u, gain);
+        }
+        else {
+          r->ver[u]++;
+        }
+      }
+    }
+  }
+
+  while (nlog > minlog) {
+    nlog--;
+    MoveState(r, log[nlog], from[nlog]);
+  }
+  return r->cost < start;
+}
+
+/*
+* Refine a partition of a graph into *npart* parts on the overhead of the
+* tile ports, with the total # of boundary nodes as a tie-breaker.
+* Part i never grows beyond cap[i] states. Only reads the graphs, so it
+* can run in several threads at once.
+*/
+void RefinePartition(graph_t *ungraph, graph_t *graph, int npart, const int *cap, char has_g4,
+                     int *where)
+{
+  int nvtxs = graph->nvtxs;
+  int nedges = graph->xadj[nvtxs];
+  int *log = (int*)malloc((nvtxs + 1) * sizeof(int));
+  int *from = (int*)malloc((nvtxs + 1) * sizeof(int));
+  portref_t r;
+  int pass, q;
+  int i, j;
+
+  if (npart < 2) {
+    free(log);
+    free(from);
+    return;
+  }
+
+  r.graph = graph;
+  r.ungraph = ungraph;
+  r.npart = npart;
+  r.cap = cap;
+  r.has_g4 = has_g4;
+  r.where = where;
+  r.size = (int*)calloc(npart, sizeof(int));
+  r.rxadj = (int*)calloc(nvtxs + 1, sizeof(int));
+  r.radjncy = (int*)malloc((nedges + 1) * sizeof(int));
+  r.nin = (int*)malloc(TILE_NUM * sizeof(int));
+  r.nout = (int*)malloc(TILE_NUM * sizeof(int));
+  r.scale = (long long)nvtxs * (npart + 1) + 1;
+  r.stamp = (int*)calloc(TILE_NUM, sizeof(int));
+  r.pstamp = (int*)calloc(TILE_NUM, sizeof(int));
+  r.vstamp = (int*)calloc(nvtxs, sizeof(int));
+  r.tick = r.ptick = r.vtick = 0;
+  r.cand = (int*)malloc(npart * sizeof(int));
+  r.aff = (int*)malloc((nvtxs + 1) * sizeof(int));
+  r.maxheap = nvtxs + 1;
+  r.heap = (fmmove_t*)malloc(r.maxheap * sizeof(fmmove_t));
+  r.nheap = 0;
+  r.ver = (int*)calloc(nvtxs, sizeof(int));
+  r.locked = (char*)calloc(nvtxs, sizeof(char));
+
+  for (i=0; i<nvtxs; i++) {
+    r.size[where[i]]++;
+  }
+
+  /* Predecessor lists */
+  for (i=0; i<nedges; i++) {
+    r.rxadj[graph->adjncy[i] + 1]++;
+  }
+  for (i=0; i<nvtxs; i++) {
+    r.rxadj[i+1] += r.rxadj[i];
+  }
+  for (i=0; i<nvtxs; i++) {
+    for (j=graph->xadj[i]; j<graph->xadj[i+1]; j++) {
+      r.radjncy[r.rxadj[graph->adjncy[j]]++] = i;
+    }
+  }
+  for (i=nvtxs; i>0; i--) {
+    r.rxadj[i] = r.rxadj[i-1];
+  }
+  r.rxadj[0] = 0;
+
+  CountBoundary(graph, where, npart, r.nin, r.nout, r.stamp);
+  for (q=0; q<TILE_NUM; q++) {
+    r.stamp[q] = 0;
+  }
+  r.cost = 0;
+  for (q=0; q<npart; q++) {
+    r.cost += PartCost(&r, q);
+  }
+
+  for (pass=0; pass<FM_NPASS; pass++) {
+    if (!RefinePass(&r, log, from)) {
+      break;
+    }
+  }
+
+  free(r.size);
+  free(r.rxadj);
+  free(r.radjncy);
+  free(r.nin);
+  free(r.nout);
+  free(r.stamp);
+  free(r.pstamp);
+  free(r.vstamp);
+  free(r.cand);
+  free(r.aff);
+  free(r.heap);
+  free(r.ver);
+  free(r.locked);
+  free(log);
+  free(from);
+}
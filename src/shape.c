@@ -0,0 +1,118 @@
+/*
+* Copyright (c) 2019, Delft University of Technology
+*
+* shape.c
+*
+* Detection of chain- and tree-shaped graphs, and a linear-time
+* partitioner for them that cuts a topological order into tile-sized
+* segments instead of calling Metis
+*/
+#include "apmapbin.h"
+
+/*
+* Classify the shape of a directed graph, leaving out self-loops, and lay
+* out its states in a topological order. The order is depth-first, so
+* that a chain or a subtree is kept together, and starts with the
+* sources in the order of their ids.
+* Returns SHAPE_CHAIN, SHAPE_TREE, SHAPE_DAG or SHAPE_CYCLIC; in the last
+* case the order is incomplete.
+*/
+int GraphShape(graph_t *graph, int *order)
+{
+  int nvtxs = graph->nvtxs;
+  int *indeg = (int*)calloc(nvtxs, sizeof(int));
+  int *stack = (int*)malloc(nvtxs * sizeof(int));
+  int maxin = 0, maxout = 0;
+  int nstack, norder, nsucc;
+  int u, v, j;
+
+  for (u=0; u<nvtxs; u++) {
+    nsucc = 0;
+    for (j=graph->xadj[u]; j<graph->xadj[u+1]; j++) {
+      v = graph->adjncy[j];
+      if (v != u) {
+        indeg[v]++;
+        nsucc++;
+      }
+    }
+    maxout = (nsucc > maxout)? nsucc: maxout;
+  }
+  for (u=0; u<nvtxs; u++) {
+    maxin = (indeg[u] > maxin)? indeg[u]: maxin;
+  }
+
+  /* Kahn's algorithm with a stack; sources are pushed in reverse to pop in order */
+  nstack = 0;
+  for (u=nvtxs-1; u>=0; u--) {
+    if (indeg[u] == 0) {
+      stack[nstack++] = u;
+    }
+  }
+  norder = 0;
+  while (nstack > 0) {
+    u = stack[--nstack];
+    order[norder++] = u;
+    for (j=graph->xadj[u+1]-1; j>=graph->xadj[u]; j--) {
+      v = graph->adjncy[j];
+      if (v != u && --indeg[v] == 0) {
+        stack[nstack++] = v;
+      }
+    }
+  }
+  free(indeg);
+  free(stack);
+
+  if (norder < nvtxs) {
+    return SHAPE_CYCLIC;
+  }
+  if (maxin <= 1) {
+    return (maxout <= 1)? SHAPE_CHAIN: SHAPE_TREE;
+  }
+  return SHAPE_DAG;
+}
+
+/*
+* Partition an acyclic graph by cutting its topological order into
+* segments: the first *headsize* states go to part 0, then TILE_SIZE
+* states to each part. This uses the least # of parts there can be.
+* The partition is only kept if no part needs more ports than a tile has,
+* in which case no partition has a lower cost, and 1 is returned.
+* Otherwise graph->where is undefined and 0 is returned.
+*/
+char ShapePartition(graph_t *graph, int headsize, char has_g4, int *npart)
+{
+  int nvtxs = graph->nvtxs;
+  int *order, *nin, *nout, *mark;
+  char found;
+  int i;
+
+  if (headsize < 1 || headsize > TILE_SIZE || nvtxs <= headsize) {
+    return 0;
+  }
+  order = (int*)malloc(nvtxs * sizeof(int));
+  if (GraphShape(graph, order) == SHAPE_CYCLIC) {
+    free(order);
+    return 0;
+  }
+
+  *npart = (nvtxs - headsize - 1) / TILE_SIZE + 2;
+  if (*npart > TILE_NUM) {
+    free(order);
+    return 0;
+  }
+  for (i=0; i<nvtxs; i++) {
+    graph->where[order[i]] = (i < headsize)? 0: (i - headsize) / TILE_SIZE + 1;
+  }
+
+  nin = (int*)malloc(TILE_NUM * sizeof(int));
+  nout = (int*)malloc(TILE_NUM * sizeof(int));
+  mark = (int*)malloc(TILE_NUM * sizeof(int));
+  CountBoundary(graph, graph->where, *npart, nin, nout, mark);
+  found = CalcBoundaryOverhead(nin, nout, *npart, has_g4) == 0;
+
+  free(order);
+  free(nin);
+  free(nout);
+  free(mark);
+  return found;
+}
@@ -16,7 +16,7 @@ void ResetTile(tile_t *tile)
 
   for (i=0; i<TILE_SIZE; i++) {
     tile->state[i] = -1;
-    tile->sname[i] = NULL;
+    tile->sname[i] = 0;
     tile->xadj[i] = 0;
   }
   tile->nstate = 0;
@@ -34,7 +34,7 @@ void ResetTile(tile_t *tile)
     tile->global[i][1] = -1;
   }
   if (tile->g4 != NULL) {
-    for (i=0; i<8; i++) {
+    for (i=0; i<G4_WIDTH; i++) {
       tile->g4[i] = -1;
     }
   }
@@ -49,10 +49,17 @@ void ResetTile(tile_t *tile)
 */
 void InitTile(tile_t *tile, char has_g4)
 {
+  tile->state = (int*)malloc(TILE_SIZE * sizeof(int));
+  tile->xadj = (int*)malloc((TILE_SIZE + MAX_IN + 1) * sizeof(int));
+  tile->sname = (unsigned*)malloc(TILE_SIZE * sizeof(unsigned));
+  tile->ste = (unsigned(*)[8])malloc(TILE_SIZE * sizeof(*tile->ste));
+  tile->start = (char*)malloc(TILE_SIZE);
+  tile->report = (char*)malloc(TILE_SIZE);
+  tile->global = (int(*)[2])malloc(GLOBAL_NUM * sizeof(*tile->global));
   InitList(&tile->out, MAX_OUT);
   tile->ghost = NULL;
   tile->adjncy = NULL;
-  tile->g4 = has_g4? (int*)malloc(sizeof(int) * 8): NULL;
+  tile->g4 = has_g4? (int*)malloc(sizeof(int) * G4_WIDTH): NULL;
   ResetTile(tile);
 }
 
@@ -74,18 +81,19 @@ void MoveStateFields(tile_t *tile, int from, int to)
 }
 
 /*
-* Resolve constraint conflicts
+* ResolveConstraint for chips of *tilenum* tiles with *max_inout* ports
+* each way
 */
-void ResolveConstraint(tile_t *tile, graph_t *graph, char has_g4)
+static GEOM_INLINE void ResolveConstraintOf(tile_t *tile, graph_t *graph, journal_t *log,
+                                            const int tilenum, const int max_inout)
 {
   list_t **ext = graph->ext;
   int index, nadd, quotient, remainder;
-  list_t *nin = (list_t*)malloc(TILE_NUM * sizeof(list_t));
+  list_t *nin = (list_t*)malloc(tilenum * sizeof(list_t));
   int realj, start;
   int i, j, k;
-  int max_inout = has_g4? GLOBAL_NUM * 2 + 8: GLOBAL_NUM * 2;
 
-  for (i=0; i<TILE_NUM; i++) {
+  for (i=0; i<tilenum; i++) {
     InitList(&nin[i], max_inout);
   }
 
@@ -93,16 +101,16 @@ void ResolveConstraint(tile_t *tile, graph_t *graph, char has_g4)
     EmptyList(&tile[0].out);
     for (i=0; i<GLOBAL_NUM; i++) {
       if (tile[0].global[i][0] != -1) {
-        tile[0].global[i][0] = -2;
+        JournalSet(log, &tile[0].global[i][0], -2);
         if (tile[0].global[i][1] != -1) {
-          tile[0].global[i][1] = -2;
+          JournalSet(log, &tile[0].global[i][1], -2);
         }
       }
     }
     if (tile[0].g4 != NULL) {
-      for (i=0; i<8; i++) {
+      for (i=0; i<G4_WIDTH; i++) {
         if (tile[0].g4[i] != -1) {
-          tile[0].g4[i] = -2;
+          JournalSet(log, &tile[0].g4[i], -2);
         }
       }
     }
@@ -224,12 +232,37 @@ void ResolveConstraint(tile_t *tile, graph_t *graph, char has_g4)
     i += nadd;
   }
 
-  for (i=0; i<TILE_NUM; i++) {
+  for (i=0; i<tilenum; i++) {
     free(nin[i].value);
   }
   free(nin);
 }
 
+/*
+* Resolve constraint conflicts. The switch entries of tile[0], which may
+* hold an earlier graph, are changed through *log*. The default geometry
+* gets copies with a constant # of tiles and ports.
+*/
+void ResolveConstraint(tile_t *tile, graph_t *graph, char has_g4, journal_t *log)
+{
+  int max_inout = has_g4? GLOBAL_NUM * 2 + G4_WIDTH: GLOBAL_NUM * 2;
+
+  if (TILE_NUM != DEF_TILE_NUM) {
+    ResolveConstraintOf(tile, graph, log, TILE_NUM, max_inout);
+    return;
+  }
+  switch (max_inout) {
+    case DEF_GLOBAL_NUM * 2 + DEF_G4_WIDTH:
+      ResolveConstraintOf(tile, graph, log, DEF_TILE_NUM, DEF_GLOBAL_NUM * 2 + DEF_G4_WIDTH);
+      break;
+    case DEF_GLOBAL_NUM * 2:
+      ResolveConstraintOf(tile, graph, log, DEF_TILE_NUM, DEF_GLOBAL_NUM * 2);
+      break;
+    default:
+      ResolveConstraintOf(tile, graph, log, DEF_TILE_NUM, max_inout);
+  }
+}
+
 /*
 * Copy graph information, such as state names and local transistion, to tiles
 */
@@ -244,7 +277,7 @@ void CopyGraphToTile(chip_t *chip, graph_t *graph, int fromtile)
   int *where = graph->where;
   int *txadj, *tadjncy, *state, nedge, to, curtile, index, gsrc, ste, src;
   int i, j, k, l;
-  char bitmap[TILE_SIZE + MAX_IN][TILE_SIZE];
+  char (*bitmap)[TILE_SIZE] = NULL;
   tile_t *tfirst = &tile[fromtile];
   char remain = 0;
   int start = fromtile;
@@ -252,7 +285,7 @@ void CopyGraphToTile(chip_t *chip, graph_t *graph, int fromtile)
 
   if (tfirst->nstate != 0) {
     remain = 1;
-    memset(bitmap, 0, (TILE_NUM + MAX_IN) * TILE_NUM);
+    bitmap = (char(*)[TILE_SIZE])calloc(TILE_SIZE + MAX_IN, TILE_SIZE);
     txadj = tfirst->xadj;
     tadjncy = tfirst->adjncy;
     for (i=0; i<TILE_SIZE+MAX_IN; i++) {
@@ -299,7 +332,7 @@ void CopyGraphToTile(chip_t *chip, graph_t *graph, int fromtile)
       }
     }
     if (tfirst->g4 != NULL) {
-      for (j=0; j<8; j++) {
+      for (j=0; j<G4_WIDTH; j++) {
         if (tfirst->g4[j] > -1) {
           to = SwapByPosValue(state, TILE_SIZE, tile[fromtile].g4[j], 2 * GLOBAL_NUM + j);
           MoveStateFields(tfirst, 2 * GLOBAL_NUM + j, to);
@@ -315,7 +348,7 @@ void CopyGraphToTile(chip_t *chip, graph_t *graph, int fromtile)
     /* Copy the fields */
     for (j=0; j<tfirst->nstate; j++) {
       if (state[j] > -1) {
-        tfirst->sname[j] = graph->name[state[j]];
+        tfirst->sname[j] = graph->nameoff[state[j]];
         tfirst->start[j] = graph->start[state[j]];
         tfirst->report[j] = graph->report[state[j]];
         for (k=0; k<8; k++) {
@@ -347,10 +380,10 @@ void CopyGraphToTile(chip_t *chip, graph_t *graph, int fromtile)
       }
     }
     if (g4 != NULL) {
-      for (k=0; k<8; k++) {
-        gsrc = g4->src[fromtile][k];
+      for (k=0; k<G4_WIDTH; k++) {
+        gsrc = g4->src[fromtile * G4_WIDTH + k];
         if (gsrc > -1) {
-          ste = tile[gsrc / 8].g4[gsrc % 8];
+          ste = tile[gsrc / G4_WIDTH].g4[gsrc % G4_WIDTH];
           for (l=gxadj[ste]; l<gxadj[ste+1]; l++) {
             to = gadjncy[l];
             if (where[to] == fromtile) {
@@ -384,6 +417,7 @@ void CopyGraphToTile(chip_t *chip, graph_t *graph, int fromtile)
         }
       }
     }
+    free(bitmap);
   }
 
   for (i=start; i<=end; i++) {
@@ -424,7 +458,7 @@ void CopyGraphToTile(chip_t *chip, graph_t *graph, int fromtile)
       }
     }
     if (tile[i].g4 != NULL) {
-      for (j=0; j<8; j++) {
+      for (j=0; j<G4_WIDTH; j++) {
         if (tile[i].g4[j] == -1) {
           break;
         }
@@ -453,11 +487,11 @@ void CopyGraphToTile(chip_t *chip, graph_t *graph, int fromtile)
       }
     }
     if (g4 != NULL) {
-      for (k=0; k<8; k++) {
+      for (k=0; k<G4_WIDTH; k++) {
         index = TILE_SIZE + GLOBAL_NUM * 2 + k;
-        gsrc = g4->src[i][k];
+        gsrc = g4->src[i * G4_WIDTH + k];
         if (gsrc != -1) {
-          ste = tile[gsrc / 8].g4[gsrc % 8];
+          ste = tile[gsrc / G4_WIDTH].g4[gsrc % G4_WIDTH];
           nedge += gxadj[ste + 1] - gxadj[ste];
         }
       }
@@ -476,7 +510,7 @@ void CopyGraphToTile(chip_t *chip, graph_t *graph, int fromtile)
     for (j=0; j<TILE_SIZE; j++) {
       txadj[j+1] = txadj[j];
       if (state[j] != -1) {
-        tile[i].sname[j] = graph->name[state[j]];
+        tile[i].sname[j] = graph->nameoff[state[j]];
         tile[i].start[j] = graph->start[state[j]];
         tile[i].report[j] = graph->report[state[j]];
         for (k=0; k<8; k++) {
@@ -512,12 +546,12 @@ void CopyGraphToTile(chip_t *chip, graph_t *graph, int fromtile)
       }
     }
     if (g4 != NULL) {
-      for (k=0; k<8; k++) {
+      for (k=0; k<G4_WIDTH; k++) {
         index = TILE_SIZE + GLOBAL_NUM * 2 + k;
         txadj[index + 1] = txadj[index];
-        gsrc = g4->src[i][k];
+        gsrc = g4->src[i * G4_WIDTH + k];
         if (gsrc != -1) {
-          ste = tile[gsrc / 8].g4[gsrc % 8];
+          ste = tile[gsrc / G4_WIDTH].g4[gsrc % G4_WIDTH];
           for (l=gxadj[ste]; l<gxadj[ste+1]; l++) {
             to = gadjncy[l];
             curtile = (tile[i].duplicated==-1)? i: tile[i].duplicated;
@@ -536,6 +570,7 @@ void CopyGraphToTile(chip_t *chip, graph_t *graph, int fromtile)
 /*
 * Copy graph information, such as state names and transistion, to tiles.
 * Simpler than CopyGraphToTile since global switches are not involved.
+* The rows of the global switches that the tile already has are kept.
 */
 void CopySmallGraphToTile(tile_t *tile, graph_t *graph)
 {
@@ -544,7 +579,7 @@ void CopySmallGraphToTile(tile_t *tile, graph_t *graph)
   int *state = tile->state;
   int *txadj = tile->xadj;
   int nvtxs = graph->nvtxs;
-  int nedge = gxadj[nvtxs] + txadj[TILE_SIZE];
+  int nedge = gxadj[nvtxs] + txadj[TILE_SIZE + MAX_IN];
   int index = 0;
   int oldxadj = 0;
   int *tadjncy;
@@ -557,7 +592,7 @@ void CopySmallGraphToTile(tile_t *tile, graph_t *graph)
     if (state[i]==-1 && index<nvtxs) {
       state[i] = index;
       pos[index] = i;
-      tile->sname[i] = graph->name[index];
+      tile->sname[i] = graph->nameoff[index];
       tile->start[i] = graph->start[index];
       tile->report[i] = graph->report[index];
       for (k=0; k<8; k++) {
@@ -573,17 +608,17 @@ void CopySmallGraphToTile(tile_t *tile, graph_t *graph)
   }
   tile->nstate += nvtxs;
 
-  /* Update the Local Switch */
+  /* Update the Local Switch; the old states keep their positions */
   tadjncy = (int*)malloc(nedge * sizeof(int));
   index = 0;
-  for (i=0; i<TILE_SIZE; i++) {
+  for (i=0; i<TILE_SIZE+MAX_IN; i++) {
     /* Copy old edges */
     for (j=oldxadj; j<txadj[i+1]; j++) {
       tadjncy[index++] = tile->adjncy[j];
     }
 
     /* Copy new edges */
-    if (state[i]!=-1 && state[i]!=TILE_SIZE) {
+    if (i<TILE_SIZE && state[i]!=-1 && state[i]!=TILE_SIZE) {
       for (j=gxadj[state[i]]; j<gxadj[state[i]+1]; j++) {
         tadjncy[index++] = pos[graph->adjncy[j]];
       }
@@ -603,51 +638,82 @@ void CopySmallGraphToTile(tile_t *tile, graph_t *graph)
 }
 
 /*
-* Write tile configuration to a file
+* Write tile configuration to an output buffer.
+* STE names are looked up in *names*, or printed as numeric ids if it is NULL.
+* In compact mode rows without any content are left out.
 */
-void EmitTile(tile_t *tile, FILE *fp)
+void EmitTile(tile_t *tile, arena_t *names, char compact, outbuf_t *out)
 {
   int *xadj = tile->xadj;
   int *adjncy = tile->adjncy;
-  int gsrc, state, index;
+  int index;
   int i, j, k;
 
   /* Print the first GLOBAL_NUM*2 lines that come from global switches */
   for (i=0; i<GLOBAL_NUM; i++) {
     for (j=0; j<2; j++) {
       index = TILE_SIZE + i * 2 + j;
-      fprintf(fp, "%d[%d]: ", i, j);
+      if (compact && xadj[index] >= xadj[index+1]) {
+        continue;
+      }
+      BufPutInt(out, i);
+      BufPutStr(out, "[");
+      BufPutInt(out, j);
+      BufPutStr(out, "]: ");
       for (k=xadj[index]; k<xadj[index+1]; k++) {
-        fprintf(fp, " %d", adjncy[k]);
+        BufPutStr(out, " ");
+        BufPutInt(out, adjncy[k]);
       }
-      fprintf(fp, "\n");
+      BufPutStr(out, "\n");
     }
   }
   if (tile->g4 != NULL) {
-    for (i=0; i<8; i++) {
+    for (i=0; i<G4_WIDTH; i++) {
       index = TILE_SIZE + 2 * GLOBAL_NUM + i;
-      fprintf(fp, "G4[%d]: ", i);
+      if (compact && xadj[index] >= xadj[index+1]) {
+        continue;
+      }
+      BufPutStr(out, "G4[");
+      BufPutInt(out, i);
+      BufPutStr(out, "]: ");
       for (k=xadj[index]; k<xadj[index+1]; k++) {
-        fprintf(fp, " %d", adjncy[k]);
+        BufPutStr(out, " ");
+        BufPutInt(out, adjncy[k]);
       }
-      fprintf(fp, "\n");
+      BufPutStr(out, "\n");
     }
   }
 
   /* Print the STEs and their corroponding part of the local switch */
   for (i=0; i<TILE_SIZE; i++) {
-    fprintf(fp, "%d: ", i);
+    if (compact && tile->state[i] == -1) {
+      continue;
+    }
+    BufPutInt(out, i);
+    BufPutStr(out, ": ");
     if (tile->state[i] != -1) {
-      fprintf(fp, "%s %d %d ", tile->sname[i], tile->start[i], tile->report[i]);
+      if (names) {
+        BufPutStr(out, ArenaGet(names, tile->sname[i]));
+      }
+      else {
+        BufPutUnsigned(out, tile->sname[i]);
+      }
+      BufPutStr(out, " ");
+      BufPutInt(out, tile->start[i]);
+      BufPutStr(out, " ");
+      BufPutInt(out, tile->report[i]);
+      BufPutStr(out, " ");
       for (j=0; j<8; j++) {
-        fprintf(fp, "%08X ", tile->ste[i][j]);
+        BufPutHex(out, tile->ste[i][j]);
+        BufPutStr(out, " ");
       }
-      fprintf(fp, "->");
+      BufPutStr(out, "->");
       for (j=xadj[i]; j<xadj[i+1]; j++) {
-        fprintf(fp, " %d", adjncy[j]);
+        BufPutStr(out, " ");
+        BufPutInt(out, adjncy[j]);
       }
     }
-    fprintf(fp, "\n");
+    BufPutStr(out, "\n");
   }
 }
 
@@ -656,16 +722,15 @@ void EmitTile(tile_t *tile, FILE *fp)
 */
 void FreeTile(tile_t *tile)
 {
-  int i;
-
   free(tile->out.value);
   FreeList(tile->ghost);
   free(tile->adjncy);
   free(tile->g4);
-  if (tile->duplicated != -1) {
-    return;
-  }
-  for (i=0; i<TILE_SIZE; i++) {
-    free(tile->sname[i]);
-  }
+  free(tile->state);
+  free(tile->xadj);
+  free(tile->sname);
+  free(tile->ste);
+  free(tile->start);
+  free(tile->report);
+  free(tile->global);
 }
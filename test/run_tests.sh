@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# Checks of Apmap on the graphs of this directory. Run by "make check".
+# The binary inputs (.apg, .apb) must give the same result as the text
+# graphs; unittest then checks the binary result, the rollback of a failed
+# mapping attempt and the partition cache.
+#
+cd "$(dirname "$0")" || exit 1
+nfail=0
+
+same() {
+  if cmp -s "$1" "$2"; then
+    echo "PASS $3"
+  else
+    echo "FAIL $3"
+    nfail=$((nfail + 1))
+  fi
+}
+
+../apmap automata.map > /dev/null || exit 1
+cp map_result text.tmp
+
+../apgconv automata.map apg.map.tmp > /dev/null || exit 1
+../apmap apg.map.tmp > /dev/null || exit 1
+same map_result text.tmp "binary graphs (.apg) give the result of the text graphs"
+
+../apgconv --bundle automata.map bundle.apb.tmp > /dev/null || exit 1
+../apmap bundle.apb.tmp > /dev/null || exit 1
+same map_result text.tmp "a bundle (.apb) gives the result of the text graphs"
+
+../apmap --no-names --emit=both automata.map > /dev/null || exit 1
+./unittest || nfail=$((nfail + 1))
+
+rm -f text.tmp apg.map.tmp bundle.apb.tmp cc0.apg cc1.apg cc2.apg map_result.apc
+if [ $nfail -ne 0 ]; then
+  echo "$nfail check(s) failed"
+  exit 1
+fi
+echo "All checks passed"
@@ -0,0 +1,423 @@
+/*
+* Copyright (c) 2019, Delft University of Technology
+*
+* unittest.c
+*
+* Checks of the parts of Apmap that the mapping result alone does not
+* show. Run from the test directory by run_tests.sh, after it wrote the
+* text and binary results of automata.map with --no-names --emit=both.
+*/
+#include "apmapbin.h"
+#include <stddef.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_DIR "cache.tmp"
+
+static int nfail = 0;
+
+/*
+* Report the outcome of a check
+*/
+static void Check(char ok, const char *what)
+{
+  printf("%s %s\n", ok? "PASS": "FAIL", what);
+  if (!ok) {
+    nfail++;
+  }
+}
+
+/*
+* A ring of *n* states, each with a transition to the next one
+*/
+static graph_t *CreateRing(int n)
+{
+  graph_t *graph = CreateGraph(n, n, 1);
+  int i;
+
+  for (i=0; i<n; i++) {
+    graph->xadj[i] = i;
+    graph->adjncy[i] = (i + 1) % n;
+    memset(&graph->ste[8 * i], 0, 8 * sizeof(unsigned));
+    graph->start[i] = (i == 0);
+    graph->report[i] = 0;
+    graph->nameoff[i] = i;
+  }
+  graph->xadj[n] = n;
+  return graph;
+}
+
+/*
+* Put the first *size* states of a graph in part 0 and the rest in part 1
+*/
+static void SplitInTwo(graph_t *graph, int size)
+{
+  int *nin = (int*)malloc(TILE_NUM * sizeof(int));
+  int *nout = (int*)malloc(TILE_NUM * sizeof(int));
+  int i;
+
+  for (i=0; i<graph->nvtxs; i++) {
+    graph->where[i] = (i < size)? 0: 1;
+  }
+  graph->npart = 2;
+  graph->cost = 2;
+  CountBoundaryNodes(graph, nin, nout);
+  free(nin);
+  free(nout);
+}
+
+/*
+* Append the switch and tile contents of a chip to *snap*
+*/
+static void Snapshot(chip_t *chip, list_t *snap)
+{
+  tile_t *tile;
+  int i, j, k;
+
+  for (j=0; j<GLOBAL_NUM; j++) {
+    for (i=0; i<TILE_NUM; i++) {
+      ListAdd(snap, chip->global[j].src[i][0]);
+      ListAdd(snap, chip->global[j].src[i][1]);
+    }
+  }
+  for (i=0; i<TILE_NUM * G4_WIDTH; i++) {
+    ListAdd(snap, chip->g4->src[i]);
+  }
+  for (i=0; i<TILE_NUM; i++) {
+    tile = &chip->tile[i];
+    ListAdd(snap, tile->nstate);
+    for (j=0; j<TILE_SIZE; j++) {
+      ListAdd(snap, tile->state[j]);
+      ListAdd(snap, tile->sname[j]);
+      ListAdd(snap, tile->start[j]);
+      ListAdd(snap, tile->report[j]);
+    }
+    for (j=0; j<=TILE_SIZE+MAX_IN; j++) {
+      ListAdd(snap, tile->xadj[j]);
+    }
+    for (j=0; j<tile->xadj[TILE_SIZE+MAX_IN]; j++) {
+      ListAdd(snap, tile->adjncy[j]);
+    }
+    for (k=0; k<GLOBAL_NUM; k++) {
+      ListAdd(snap, tile->global[k][0]);
+      ListAdd(snap, tile->global[k][1]);
+    }
+    for (k=0; k<G4_WIDTH; k++) {
+      ListAdd(snap, tile->g4[k]);
+    }
+  }
+}
+
+/*
+* A chip with the small graph of cc2.graph in tile 0, so that a large
+* graph shares that tile and MapGlobal journals changes to it
+*/
+static void InitSharedChip(chip_t *chip, graph_t *small)
+{
+  ChipInit(chip, 1);
+  CopySmallGraphToTile(&chip->tile[0], small);
+  chip->remain -= small->nvtxs;
+}
+
+/*
+* A large graph that runs out of global switches must leave the switches
+* and the tiles of the chip as they were
+*/
+static void TestRollback(void)
+{
+  graph_t *small = CreateGraph(6, 7, 1);
+  graph_t *ring;
+  int nring = TILE_SIZE + TILE_SIZE / 4;
+  list_t before, after;
+  static chip_t chip;
+  char ok;
+  int i, j;
+
+  ReadGraphFile(small, "cc2.graph", 6, 7);
+  ring = CreateRing(nring);
+
+  /* The switches can take the ring when they are free */
+  InitSharedChip(&chip, small);
+  SplitInTwo(ring, TILE_SIZE - small->nvtxs);
+  Check(MapLargeGraph(&chip, ring, 1) == 1, "a large graph maps onto free switches");
+  FreeChip(&chip);
+
+  /* Every switch input is taken, so MapGlobal fails after ResolveConstraint */
+  InitSharedChip(&chip, small);
+  for (j=0; j<GLOBAL_NUM; j++) {
+    for (i=0; i<TILE_NUM; i++) {
+      chip.global[j].src[i][0] = chip.global[j].src[i][1] = 2 * (TILE_NUM - 1);
+    }
+  }
+  for (i=0; i<TILE_NUM * G4_WIDTH; i++) {
+    chip.g4->src[i] = G4_WIDTH * (TILE_NUM - 1);
+  }
+  SplitInTwo(ring, TILE_SIZE - small->nvtxs);
+
+  InitList(&before, 1024);
+  InitList(&after, 1024);
+  Snapshot(&chip, &before);
+  Check(MapLargeGraph(&chip, ring, 1) == -1, "a large graph fails on taken switches");
+  Snapshot(&chip, &after);
+  ok = before.size == after.size &&
+       memcmp(before.value, after.value, before.size * sizeof(int)) == 0;
+  Check(ok, "a failed attempt leaves the switches and tiles unchanged");
+  Check(ring->npart == 2 && chip.journal.size == 0, "a failed attempt restores the graph");
+
+  free(before.value);
+  free(after.value);
+  FreeChip(&chip);
+  FreeGraph(&ring, nring);
+  FreeGraph(&small, 6);
+}
+
+/*
+* Read a whole file. Returns its size, or -1 if it cannot be read.
+*/
+static long ReadWhole(const char *file, char **data)
+{
+  FILE *fp = fopen(file, "rb");
+  long size;
+
+  if (!fp) {
+    return -1;
+  }
+  fseek(fp, 0, SEEK_END);
+  size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  *data = (char*)malloc(size + 1);
+  size = fread(*data, 1, size, fp);
+  fclose(fp);
+  return size;
+}
+
+/*
+* Write *size* bytes of *data* to a file
+*/
+static void WriteWhole(const char *file, const char *data, long size)
+{
+  FILE *fp = fopen(file, "wb");
+
+  if (!fp || fwrite(data, 1, size, fp) != (size_t)size) {
+    errexit("Cannot write %s!\n", file);
+  }
+  fclose(fp);
+}
+
+/*
+* Write a copy of a cache entry with the int at byte *offset* set to
+* *value*, or, if *cut* is set, with only its first *offset* bytes.
+* Returns whether LoadPartition takes it.
+*/
+static char LoadDamaged(const char *fname, const char *entry, long size, long offset,
+                        int value, char cut, unsigned long long key[2], graph_t *graph,
+                        graph_t *ungraph, list_t *choice)
+{
+  char *copy = (char*)malloc(size);
+
+  memcpy(copy, entry, size);
+  if (cut) {
+    size = offset;
+  }
+  else {
+    memcpy(copy + offset, &value, sizeof(int));
+  }
+  WriteWhole(fname, copy, size);
+  free(copy);
+  return LoadPartition(CACHE_DIR, key, graph, ungraph, choice);
+}
+
+/*
+* A damaged partition cache entry must be a miss and must not touch the graph
+*/
+static void TestCache(void)
+{
+  graph_t *graph, *ungraph;
+  unsigned long long key[2];
+  long where0 = sizeof(pcache_header_t);
+  long choice0;
+  list_t choice;
+  mapopt_t opt;
+  char fname[64];
+  char *entry;
+  long size;
+  char ok;
+  int i;
+
+  InitMapOpt(&opt);
+  graph = CreateRing(40);
+  ungraph = CreateGraph(40, 80, 0);
+  SplitInTwo(graph, 24);
+  ungraph->npart = 2;
+  InitList(&choice, 4);
+  ListAdd(&choice, 2);
+  ListAdd(&choice, 8);
+  ListAdd(&choice, -1);
+
+  mkdir(CACHE_DIR, 0755);
+  PartitionKey(graph, TILE_SIZE, 1, &opt, key);
+  StorePartition(CACHE_DIR, key, graph, ungraph, &choice);
+  sprintf(fname, "%s/%016llx.part", CACHE_DIR, key[0]);
+  size = ReadWhole(fname, &entry);
+  Check(size > where0, "a partition is stored in the cache");
+  if (size <= where0) {
+    return;
+  }
+  choice0 = where0 + graph->nvtxs * sizeof(int);
+
+  /* The intact entry is a hit and restores the partition */
+  for (i=0; i<graph->nvtxs; i++) {
+    graph->where[i] = 0;
+  }
+  EmptyList(&choice);
+  ok = LoadPartition(CACHE_DIR, key, graph, ungraph, &choice) && choice.size == 3;
+  for (i=0; ok && i<graph->nvtxs; i++) {
+    ok = graph->where[i] == ((i < 24)? 0: 1);
+  }
+  Check(ok, "an intact cache entry is a hit");
+
+  for (i=0; i<graph->nvtxs; i++) {
+    graph->where[i] = 7;
+  }
+  Check(!LoadDamaged(fname, entry, size, size - 4, -1, 1, key, graph, ungraph, &choice),
+        "a truncated cache entry is a miss");
+  Check(!LoadDamaged(fname, entry, size, 0, 0, 0, key, graph, ungraph, &choice),
+        "a cache entry with a bad magic is a miss");
+  Check(!LoadDamaged(fname, entry, size, offsetof(pcache_header_t, upart), TILE_NUM + 1, 0,
+                     key, graph, ungraph, &choice),
+        "a cache entry with too many parts is a miss");
+  Check(!LoadDamaged(fname, entry, size, offsetof(pcache_header_t, cost), 1, 0,
+                     key, graph, ungraph, &choice),
+        "a cache entry cheaper than its parts is a miss");
+  Check(!LoadDamaged(fname, entry, size, where0, 2, 0, key, graph, ungraph, &choice),
+        "a cache entry with a state outside its parts is a miss");
+  Check(!LoadDamaged(fname, entry, size, choice0, TILE_NUM + 1, 0, key, graph, ungraph, &choice),
+        "a cache entry with a bad fallback choice is a miss");
+  ok = 1;
+  for (i=0; i<graph->nvtxs; i++) {
+    ok = ok && graph->where[i] == 7;
+  }
+  Check(ok, "a damaged cache entry leaves the graph alone");
+
+  remove(fname);
+  rmdir(CACHE_DIR);
+  free(entry);
+  free(choice.value);
+  FreeGraph(&graph, 40);
+  FreeGraph(&ungraph, 40);
+}
+
+/*
+* Set bit *c* of a bit row
+*/
+static void SetRowBit(unsigned char *row, int c)
+{
+  row[c / 8] |= 1 << (c % 8);
+}
+
+/*
+* The targets after *p* as a bit row; "->" is skipped
+*/
+static void ParseTargets(const char *p, unsigned char *row, size_t rowbytes)
+{
+  int value, len;
+
+  memset(row, 0, rowbytes);
+  while (sscanf(p, "%d%n", &value, &len) == 1) {
+    SetRowBit(row, value);
+    p += len;
+  }
+}
+
+/*
+* Compare the tiles of the text result written with --no-names against
+* the binary result of the same run
+*/
+static void TestConfig(void)
+{
+  apmap_config_t *cfg = ApmapOpenConfig("map_result.apc");
+  FILE *fp = fopen("map_result", "r");
+  size_t linelen = 1 << 16;
+  char *line = (char*)malloc(linelen);
+  unsigned char *row;
+  apmap_tilecfg_t tc;
+  unsigned ste[8];
+  int chip = -1, tile = -1, ntile = 0;
+  int r, k, id, start, report, len;
+  const char *p;
+  char ok = 1;
+
+  if (!cfg || !fp) {
+    errexit("Cannot open map_result!\n");
+  }
+  row = (unsigned char*)malloc(cfg->rowbytes);
+  Check(ApmapOpenConfig("map_result") == NULL, "the text result is not opened as a binary one");
+  Check(ApmapGetTile(cfg, cfg->nchip, 0, &tc) == -1 && ApmapGetTile(cfg, 0, -1, &tc) == -1,
+        "a tile out of the binary result is not located");
+
+  while (ok && getline(&line, &linelen, fp) != -1) {
+    if (sscanf(line, "*** Chip %d ***", &chip) == 1) {
+      tile = -1;
+      continue;
+    }
+    if (sscanf(line, "--- Tile %d ---", &tile) == 1) {
+      ok = ApmapGetTile(cfg, chip, tile, &tc) == 0;
+      ntile += ok;
+      continue;
+    }
+    if (line[0] == '-' || tile < 0) {
+      tile = (line[0] == '-')? -1: tile;
+      continue;
+    }
+
+    /* A switch input row, a G4 input row or an STE row */
+    if (sscanf(line, "%d[%d]: %n", &r, &k, &len) == 2) {
+      r = cfg->tile_size + 2 * r + k;
+    }
+    else if (sscanf(line, "G4[%d]: %n", &k, &len) == 1) {
+      r = cfg->tile_size + 2 * cfg->global_num + k;
+    }
+    else if (sscanf(line, "%d: %n", &r, &len) == 1) {
+      p = line + len;
+      if (sscanf(p, "%d %d %d %x %x %x %x %x %x %x %x %n", &id, &start, &report,
+                 &ste[0], &ste[1], &ste[2], &ste[3], &ste[4], &ste[5], &ste[6], &ste[7],
+                 &len) == 11) {
+        ok = ((tc.used[r / 8] >> (r % 8)) & 1) &&
+             ((tc.start[r / 8] >> (r % 8)) & 1) == start &&
+             ((tc.report[r / 8] >> (r % 8)) & 1) == report &&
+             memcmp(ste, &tc.ste[8 * r], sizeof(ste)) == 0;
+        len = (int)(p - line) + len + 2; /* Skip "->" */
+      }
+      else {
+        ok = !((tc.used[r / 8] >> (r % 8)) & 1);
+      }
+    }
+    else {
+      continue;
+    }
+    if (ok) {
+      ParseTargets(line + len, row, cfg->rowbytes);
+      ok = memcmp(row, tc.local + r * cfg->rowbytes, cfg->rowbytes) == 0;
+    }
+  }
+
+  for (k=0; ok && k<cfg->nchip; k++) {
+    ntile -= cfg->chip[k].ntile;
+  }
+  Check(ok && ntile == 0, "the binary result holds the tiles of the text result");
+
+  fclose(fp);
+  free(line);
+  free(row);
+  ApmapCloseConfig(cfg);
+}
+
+int main(int argc, char *argv[])
+{
+  /* Small tiles, so that a graph of a few dozen states is large */
+  ParseGeometry("tile-size=32,tiles=8,globals=2,g4-width=4,threshold=0", "unittest");
+  TestRollback();
+  TestCache();
+  TestConfig();
+  return nfail > 0;
+}
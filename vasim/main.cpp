@@ -8,16 +8,247 @@
 #include <thread>
 #include "errno.h"
 #include <sys/stat.h> // added by Jintao Yu
+#include <cstring>
+#include "apmap.h" // Apmap library interface
 
 #define FROM_INPUT_STRING false
 
 using namespace std;
 
+/**
+ * Count the states and the transitions of a connected component as Apmap
+ * sees them, i.e. without special elements.
+ */
+void apmapSize(Automata *a, uint32_t &nstate, uint32_t &nedge) {
+  nstate = a->getElements().size() - a->getSpecialElements().size();
+  nedge = 0;
+  for (auto e : a->getElements()) {
+    if (!e.second->isSpecialElement()) {
+      for (auto target : e.second->getOutputs()) {
+        if (!a->getElement(target)->isSpecialElement()) {
+          nedge++;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Serialize one connected component as a text Apmap graph file (.graph).
+ */
+string automataToGraphString(Automata *a) {
+  string str = "";
+
+  //add all nodes
+  uint32_t id = 0;
+  map<string, uint32_t> id_map;
+  map<uint32_t, string> name_map;
+  vector<bool> report;
+  vector<bool> start;
+  for (auto e : a->getElements()) {
+    if (!e.second->isSpecialElement()) {
+      // map ids to string names
+      id_map[e.first] = id;
+      name_map[id] = e.first;
+      start.push_back(dynamic_cast<STE*>(e.second)->isStart());
+      report.push_back(e.second->isReporting());
+      id++;
+    }
+  }
+
+  for (int i = 0; i < id; i++) {
+    string name = name_map[i];
+    str += name + " " + to_string(start[i]) + " " + to_string(report[i]) + " ";
+
+    auto ele = a->getElement(name);
+    auto ste = static_cast<STE*>(ele);
+    bitset<256> bits = ste->getBitColumn();
+    for (int i = 0; i < 8; i++) {
+      unsigned result = 0;
+      unsigned mask = 1;
+      for (int j = 32 * i; j < 32 * (i + 1); j++) {
+        if (bits[j]) {
+          result |= mask;
+        }
+        mask <<= 1;
+      }
+      static const char* digits = "0123456789ABCDEF";
+      std::string rc(8, '0');
+      for (size_t i = 0, j = 28; i < 8; ++i, j -= 4) {
+        rc[i] = digits[(result >> j) & 0x0f];
+      }
+      str += rc + " ";
+    }
+
+    auto eles = ele->getOutputs();
+    for (auto to_ele : eles) {
+      if (!a->getElement(to_ele)->isSpecialElement()) {
+        unsigned int to = id_map[to_ele] + 1;
+        str += to_string(to) + " ";
+      }
+    }
+    str += "\n";
+  }
+  return str;
+}
+
+/**
+ * A connected component in the CSR form used by Apmap.
+ */
+struct ApmapGraph {
+  vector<int32_t> xadj;
+  vector<int32_t> adjncy;
+  vector<uint32_t> ste;
+  vector<char> start;
+  vector<char> report;
+  vector<string> names;
+};
+
+/**
+ * Convert one connected component to CSR form. States are numbered in the
+ * same order as in the text format.
+ */
+void automataToApmapGraph(Automata *a, ApmapGraph &g) {
+  map<string, uint32_t> id_map;
+  for (auto e : a->getElements()) {
+    if (!e.second->isSpecialElement()) {
+      id_map[e.first] = g.names.size();
+      g.names.push_back(e.first);
+    }
+  }
+
+  g.xadj.push_back(0);
+  for (uint32_t i = 0; i < g.names.size(); i++) {
+    auto ele = a->getElement(g.names[i]);
+    auto s = static_cast<STE*>(ele);
+    g.start.push_back(s->isStart());
+    g.report.push_back(ele->isReporting());
+
+    bitset<256> bits = s->getBitColumn();
+    for (int k = 0; k < 8; k++) {
+      uint32_t result = 0;
+      for (int j = 0; j < 32; j++) {
+        if (bits[32 * k + j]) {
+          result |= 1u << j;
+        }
+      }
+      g.ste.push_back(result);
+    }
+
+    for (auto to_ele : ele->getOutputs()) {
+      if (!a->getElement(to_ele)->isSpecialElement()) {
+        g.adjncy.push_back(id_map[to_ele]);
+      }
+    }
+    g.xadj.push_back(g.adjncy.size());
+  }
+}
+
+/**
+ * Serialize one connected component as a binary Apmap graph file (.apg).
+ * The layout must match apg_header_t in apmap's include/struct.h.
+ */
+string automataToApgString(Automata *a) {
+  ApmapGraph g;
+  automataToApmapGraph(a, g);
+
+  vector<uint32_t> nameoff;
+  string strtab;
+  for (auto &name : g.names) {
+    nameoff.push_back(strtab.size());
+    strtab += name;
+    strtab.push_back('\0');
+  }
+
+  uint32_t header[6] = {0, 1, (uint32_t)g.names.size(), (uint32_t)g.adjncy.size(),
+                        (uint32_t)strtab.size(), 0};
+  memcpy(header, "APG\0", 4);
+
+  string out((const char*)header, sizeof(header));
+  out.append((const char*)g.xadj.data(), g.xadj.size() * sizeof(int32_t));
+  out.append((const char*)g.adjncy.data(), g.adjncy.size() * sizeof(int32_t));
+  out.append((const char*)g.ste.data(), g.ste.size() * sizeof(uint32_t));
+  out.append(g.start.data(), g.start.size());
+  out.append(g.report.data(), g.report.size());
+  out.append((const char*)nameoff.data(), nameoff.size() * sizeof(uint32_t));
+  out.append(strtab);
+  return out;
+}
+
+/**
+ * Map the connected components with the linked Apmap library.
+ * Only the configuration (map_result) is written to disk.
+ */
+void automataToApmapResult(vector<Automata*> &ccs) {
+  vector<ApmapGraph> graphs(ccs.size());
+  vector<vector<const char*>> names(ccs.size());
+  vector<apmap_cc_t> cc(ccs.size());
+
+  for (int i = 0; i < ccs.size(); i++) {
+    automataToApmapGraph(ccs[i], graphs[i]);
+    for (auto &name : graphs[i].names) {
+      names[i].push_back(name.c_str());
+    }
+    cc[i].nstate = graphs[i].names.size();
+    cc[i].nedge = graphs[i].adjncy.size();
+    cc[i].xadj = graphs[i].xadj.data();
+    cc[i].adjncy = graphs[i].adjncy.data();
+    cc[i].ste = graphs[i].ste.data();
+    cc[i].start = graphs[i].start.data();
+    cc[i].report = graphs[i].report.data();
+    cc[i].name = names[i].data();
+  }
+  ApmapMapCC(cc.data(), cc.size(), 1, 0, "map_result");
+}
+
+/**
+ * Export automata to a single bundled archive (.apb) readable by Apmap.
+ * The layout must match apb_header_t and apb_entry_t in apmap's include/struct.h.
+ */
+void automataToApmapBundle(vector<Automata*> &ccs, string fn, bool binary) {
+  struct entry_t {
+    uint32_t nstate;
+    uint32_t nedge;
+    uint64_t offset;
+    uint64_t length;
+  };
+  vector<entry_t> index(ccs.size());
+  uint32_t header[4] = {0, 1, (uint32_t)ccs.size(), 0};
+  memcpy(header, "APB\0", 4);
+
+  string path = fn + ".apb";
+  ofstream out(path, ios::binary);
+  uint64_t offset = sizeof(header) + index.size() * sizeof(entry_t);
+  out.seekp(offset);
+  for (int i = 0; i < ccs.size(); i++) {
+    string payload = binary ? automataToApgString(ccs[i]) : automataToGraphString(ccs[i]);
+    apmapSize(ccs[i], index[i].nstate, index[i].nedge);
+    index[i].offset = offset;
+    index[i].length = payload.size();
+    out.write(payload.data(), payload.size());
+    offset += payload.size();
+  }
+  out.seekp(0);
+  out.write((const char*)header, sizeof(header));
+  out.write((const char*)index.data(), index.size() * sizeof(entry_t));
+  if (!out) {
+    cout << "Cannot write " << path << endl;
+    exit(-1);
+  }
+}
+
 /**
  * Export automata to file readable by Apmap.
+ * If binary is set, the connected components are written as .apg files.
+ * If bundle is set, everything is packed into one .apb file instead.
  * Added by Jintao Yu
  */
-void automataToApmapFile(vector<Automata*> &ccs, string fn) {
+void automataToApmapFile(vector<Automata*> &ccs, string fn, bool binary, bool bundle) {
+  if (bundle) {
+    automataToApmapBundle(ccs, fn, binary);
+    return;
+  }
+
   // Creating a directory
   string dir = fn + ".map";
   int ret = mkdir(dir.c_str(), 0777);
@@ -40,80 +271,23 @@ void automataToApmapFile(vector<Automata*> &ccs, string fn) {
   int count = 0;
 
   for (Automata *a : ccs) {
-    str += to_string(a->getElements().size() - a->getSpecialElements().size()) + " ";
-
-    int nedge = 0;
-    for (auto e : a->getElements()) {
-      if (!e.second->isSpecialElement()) {
-        for (auto target : e.second->getOutputs()) {
-          if (!a->getElement(target)->isSpecialElement()) {
-            nedge++;
-          }
-        }
-      }
-    }
+    uint32_t nstate, nedge;
+    apmapSize(a, nstate, nedge);
+    str += to_string(nstate) + " ";
     str += to_string(nedge) + " ";
-    str += fn + ".CC" + to_string(count) + ".graph\n";
+    str += fn + ".CC" + to_string(count) + (binary ? ".apg\n" : ".graph\n");
     count++;
   }
   writeStringToFile(str, dir + "/" + dir);
 
   int index = 0;
   for (Automata *a : ccs) {
-    str = "";
-
-    //add all nodes
-    uint32_t id = 0;
-    map<string, uint32_t> id_map;
-    map<uint32_t, string> name_map;
-    vector<bool> report;
-    vector<bool> start;
-    for (auto e : a->getElements()) {
-      if (!e.second->isSpecialElement()) {
-        // map ids to string names
-        id_map[e.first] = id;
-        name_map[id] = e.first;
-        start.push_back(dynamic_cast<STE*>(e.second)->isStart());
-        report.push_back(e.second->isReporting());
-        id++;
-      }
+    if (binary) {
+      writeStringToFile(automataToApgString(a), dir + "/" + fn + ".CC" + to_string(index) + ".apg");
     }
-
-    for (int i = 0; i < id; i++) {
-      string name = name_map[i];
-      str += name + " " + to_string(start[i]) + " " + to_string(report[i]) + " ";
-
-      auto ele = a->getElement(name);
-      auto ste = static_cast<STE*>(ele);
-      bitset<256> bits = ste->getBitColumn();
-      for (int i = 0; i < 8; i++) {
-        unsigned result = 0;
-        unsigned mask = 1;
-        for (int j = 32 * i; j < 32 * (i + 1); j++) {
-          if (bits[j]) {
-            result |= mask;
-          }
-          mask <<= 1;
-        }
-        static const char* digits = "0123456789ABCDEF";
-        std::string rc(8, '0');
-        for (size_t i = 0, j = 28; i < 8; ++i, j -= 4) {
-          rc[i] = digits[(result >> j) & 0x0f];
-        }
-        str += rc + " ";
-      }
-
-      auto eles = ele->getOutputs();
-      for (auto to_ele : eles) {
-        if (!a->getElement(to_ele)->isSpecialElement()) {
-          unsigned int to = id_map[to_ele] + 1;
-          str += to_string(to) + " ";
-        }
-      }
-      str += "\n";
+    else {
+      writeStringToFile(automataToGraphString(a), dir + "/" + fn + ".CC" + to_string(index) + ".graph");
     }
-
-    writeStringToFile(str, dir + "/" + fn + ".CC" + to_string(index) + ".graph");
     index++;
   }
 }
@@ -141,6 +315,9 @@ void usage(char * argv) {
     printf("  -f, --hdl                 Output automata as one-hot encoded verilog HDL for execution on an FPGA (EXPERIMENTAL)\n");    
     printf("  -B, --blif                Output automata as .blif circuit for place-and-route using VPR.\n");
     printf("      --graph               Output automata as .graph file for HyperScan.\n");
+    printf("      --apg                 Output connected components as binary .apg files for Apmap.\n");
+    printf("      --apmap-bundle        Output all connected components for Apmap as one .apb archive.\n");
+    printf("      --apmap-map           Map connected components with the linked Apmap library and write map_result.\n");
 
     printf("\n OPTIMIZATIONS:\n");    
     printf("  -O, --optimize-global     Run all optimizations on all automata subgraphs.\n");
@@ -199,6 +376,9 @@ int main(int argc, char * argv[]) {
     bool to_hdl = false;
     bool to_blif = false;
     bool to_apmap = false; // added by Jintao Yu
+    bool to_apg = false;
+    bool to_apb = false;
+    bool apmap_direct = false;
     uint32_t num_threads = 1;
     uint32_t num_threads_packets = 1;
     bool to_graph = false;
@@ -216,6 +396,9 @@ int main(int argc, char * argv[]) {
     const int32_t dump_state_switch = 1003;
     const int32_t widen_switch = 1004;
     const int32_t two_stride_switch = 1005;
+    const int32_t apg_switch = 1006;
+    const int32_t apb_switch = 1007;
+    const int32_t apmap_direct_switch = 1008;
     
     int c;
     const char * short_opt = "thsqrbnfcdBDeamxipOLT:P:A";
@@ -248,6 +431,9 @@ int main(int argc, char * argv[]) {
         {"widen",         no_argument, NULL, widen_switch},
         {"2-stride",         no_argument, NULL, two_stride_switch},
         {"apmap",         no_argument, NULL, 'A'}, // added by Jintao Yu
+        {"apg",         no_argument, NULL, apg_switch},
+        {"apmap-bundle",         no_argument, NULL, apb_switch},
+        {"apmap-map",         no_argument, NULL, apmap_direct_switch},
         {NULL,            0,           NULL, 0  }
     };
     
@@ -359,6 +545,20 @@ int main(int argc, char * argv[]) {
             to_graph = true;
             break;
 
+        case apg_switch:
+            to_apmap = true;
+            to_apg = true;
+            break;
+
+        case apb_switch:
+            to_apmap = true;
+            to_apb = true;
+            break;
+
+        case apmap_direct_switch:
+            apmap_direct = true;
+            break;
+
         case fanin_switch:
             fanin_limit = atoi(optarg);
             if(fanin_limit < 1){
@@ -519,8 +719,11 @@ int main(int argc, char * argv[]) {
         num_threads = ccs.size();
     }
 
-    if (to_apmap) {
-      automataToApmapFile(ccs, fn);
+    if (apmap_direct) {
+      automataToApmapResult(ccs);
+    }
+    else if (to_apmap) {
+      automataToApmapFile(ccs, fn, to_apg, to_apb);
     }
 
     unsigned int counter = 0;